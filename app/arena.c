@@ -0,0 +1,136 @@
+/**
+ * @file arena.c
+ * @brief Bump allocator for memory that lives as long as one request
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+typedef struct arena_block_t
+{
+    struct arena_block_t *next;
+    size_t size;
+} arena_block_t;
+
+/* Region data starts after the header, kept aligned */
+#define BLOCK_HEADER ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_stats_t totals;
+
+static int block_push(arena_t *arena, size_t size)
+{
+    arena_block_t *block = (arena_block_t *)malloc(BLOCK_HEADER + size);
+    if (block == NULL)
+    {
+        return -1;
+    }
+    arena->heap_allocations++;
+    __atomic_fetch_add(&totals.heap_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals.heap_bytes, BLOCK_HEADER + size, __ATOMIC_RELAXED);
+
+    block->next = arena->blocks;
+    block->size = size;
+    arena->blocks = block;
+    arena->base = (char *)block + BLOCK_HEADER;
+    arena->size = size;
+    arena->used = 0;
+    return 0;
+}
+
+static void blocks_free(arena_t *arena)
+{
+    while (arena->blocks != NULL)
+    {
+        arena_block_t *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->base = arena->initial;
+    arena->size = ARENA_INITIAL_SIZE;
+    arena->used = 0;
+}
+
+void arena_init(arena_t *arena)
+{
+    arena->base = arena->initial;
+    arena->size = ARENA_INITIAL_SIZE;
+    arena->used = 0;
+    arena->requested = 0;
+    arena->spilled = 0;
+    arena->blocks = NULL;
+    arena->heap_allocations = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    if (size > SIZE_MAX - ARENA_ALIGN)
+    {
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (arena->size - arena->used < size)
+    {
+        /* Whatever is left of the current region is abandoned until the reset */
+        if (block_push(arena, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE) != 0)
+        {
+            return NULL;
+        }
+        arena->spilled = 1;
+    }
+
+    char *memory = arena->base + arena->used;
+    arena->used += size;
+    arena->requested += size;
+    __atomic_fetch_add(&totals.allocations, 1, __ATOMIC_RELAXED);
+    return memory;
+}
+
+char *arena_strdup(arena_t *arena, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    char *copy = (char *)arena_alloc(arena, length);
+    if (copy != NULL)
+    {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+void arena_reset(arena_t *arena)
+{
+    size_t requested = arena->requested;
+    __atomic_fetch_add(&totals.resets, 1, __ATOMIC_RELAXED);
+
+    arena->used = 0;
+    arena->requested = 0;
+    if (!arena->spilled)
+    {
+        return;
+    }
+
+    /* One region that would have held the whole request, unless it was huge */
+    arena->spilled = 0;
+    blocks_free(arena);
+    if (requested > ARENA_INITIAL_SIZE && requested <= ARENA_RETAIN)
+    {
+        /* On failure the initial region still works */
+        block_push(arena, requested);
+    }
+}
+
+void arena_destroy(arena_t *arena)
+{
+    blocks_free(arena);
+}
+
+void arena_stats(arena_stats_t *stats)
+{
+    stats->allocations = __atomic_load_n(&totals.allocations, __ATOMIC_RELAXED);
+    stats->heap_allocations = __atomic_load_n(&totals.heap_allocations, __ATOMIC_RELAXED);
+    stats->heap_bytes = __atomic_load_n(&totals.heap_bytes, __ATOMIC_RELAXED);
+    stats->resets = __atomic_load_n(&totals.resets, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,116 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file arena.h
+     * @brief Bump allocator for memory that lives as long as one request
+     *
+     * Allocations are carved from the current region and never freed one
+     * by one, arena_reset() takes everything back at once. The first region
+     * is part of the arena itself. When a request needs more, heap regions
+     * are chained on, and the next reset replaces them with a single region
+     * big enough for the whole request, so a connection that keeps asking
+     * for the same amount stops calling malloc() after its first request.
+     */
+
+#define ARENA_INITIAL_SIZE 4096
+#define ARENA_BLOCK_SIZE 16384         // smallest heap region
+#define ARENA_RETAIN (256 * 1024)      // larger regions are given back on reset
+#define ARENA_ALIGN 16
+
+    struct arena_block_t;
+
+    /**
+     *  @struct arena_t
+     *  @brief A bump allocator
+     *
+     *  @var base               Region allocations are carved from.
+     *  @var used               Bytes of base handed out.
+     *  @var requested          Bytes handed out since the last reset.
+     *  @var spilled            A request outgrew base since the last reset.
+     *  @var blocks             Heap regions, newest first.
+     *  @var heap_allocations   malloc() calls made by this arena.
+     *  @var initial            First region, used until a request outgrows it.
+     */
+    typedef struct
+    {
+        char *base;
+        size_t size;
+        size_t used;
+        size_t requested;
+        int spilled;
+        struct arena_block_t *blocks;
+        unsigned long long heap_allocations;
+        char initial[ARENA_INITIAL_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+    } arena_t;
+
+    /**
+     *  @struct arena_stats_t
+     *  @brief Totals over every arena in the process
+     *
+     *  @var allocations        arena_alloc() calls.
+     *  @var heap_allocations   malloc() calls made to grow an arena.
+     *  @var heap_bytes         Bytes those calls asked for.
+     *  @var resets             arena_reset() calls, one per request.
+     */
+    typedef struct
+    {
+        unsigned long long allocations;
+        unsigned long long heap_allocations;
+        unsigned long long heap_bytes;
+        unsigned long long resets;
+    } arena_stats_t;
+
+    /**
+     * @function arena_init
+     * @brief Sets up an empty arena backed by its initial region.
+     */
+    void arena_init(arena_t *arena);
+
+    /**
+     * @function arena_alloc
+     * @brief Hands out size bytes aligned to ARENA_ALIGN, valid until the
+     *        next arena_reset().
+     * @return the memory, or NULL when the heap is exhausted
+     */
+    void *arena_alloc(arena_t *arena, size_t size);
+
+    /**
+     * @function arena_strdup
+     * @brief Copies a NUL terminated string into the arena.
+     * @return the copy, or NULL when the heap is exhausted
+     */
+    char *arena_strdup(arena_t *arena, const char *string);
+
+    /**
+     * @function arena_reset
+     * @brief Takes back every allocation. Heap regions are merged into one
+     *        sized for the request that just ended, up to ARENA_RETAIN.
+     */
+    void arena_reset(arena_t *arena);
+
+    /**
+     * @function arena_destroy
+     * @brief Frees the heap regions. The arena must be initialised again
+     *        before reuse.
+     */
+    void arena_destroy(arena_t *arena);
+
+    /**
+     * @function arena_stats
+     * @brief Reads the process wide counters.
+     */
+    void arena_stats(arena_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ARENA_H_ */
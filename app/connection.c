@@ -0,0 +1,498 @@
+/**
+ * @file connection.c
+ * @brief Connection allocation and nonblocking output
+ */
+
+#define _GNU_SOURCE // IOV_MAX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "slab.h"
+
+#define CHUNK_HEAD 16 // room for the hex size line in front of a chunk
+#define CHUNK_LAST "0\r\n\r\n"
+
+/**
+ *  @struct connection_stream_t
+ *  @brief An encoded file body on its way out
+ *
+ *  @var encoder        Compressor state.
+ *  @var input          Unencoded bytes of window left to feed in.
+ *  @var eof            The whole file has been read.
+ *  @var done           The encoder has produced its last byte.
+ *  @var frame_start    Offset of the chunk being sent within frame.
+ *  @var window         File bytes read but not yet encoded.
+ *  @var frame          Size line, encoded data, CRLF and maybe the last chunk.
+ */
+typedef struct connection_stream_t
+{
+    encoding_stream_t *encoder;
+    const char *input;
+    size_t input_length;
+    int eof;
+    int done;
+    size_t frame_start;
+    size_t frame_length;
+    size_t frame_sent;
+    char window[CONNECTION_STREAM_WINDOW];
+    char frame[CHUNK_HEAD + CONNECTION_STREAM_WINDOW + sizeof("\r\n" CHUNK_LAST)];
+} connection_stream_t;
+
+static slab_t *connection_slab;
+
+static void stream_free(struct Connection *connection)
+{
+    encoding_stream_destroy(connection->stream->encoder);
+    free(connection->stream);
+    connection->stream = NULL;
+    if (connection->file_fd != -1)
+    {
+        close(connection->file_fd);
+        connection->file_fd = -1;
+    }
+}
+
+int connection_pool_init(size_t capacity)
+{
+    connection_slab = slab_create(sizeof(struct Connection), capacity);
+    return connection_slab != NULL ? 0 : -1;
+}
+
+size_t connection_pool_bytes(void)
+{
+    return connection_slab != NULL ? slab_bytes(connection_slab) : 0;
+}
+
+void connection_pool_destroy(void)
+{
+    slab_destroy(connection_slab);
+    connection_slab = NULL;
+}
+
+struct Connection *connection_create(int client_fd, const struct sockaddr_in *client_addr)
+{
+    struct Connection *connection = (struct Connection *)slab_alloc(connection_slab);
+    if (connection == NULL)
+    {
+        errno = EMFILE;
+        return NULL;
+    }
+
+    connection->client_addr = *client_addr;
+    connection->client_fd = client_fd;
+    connection->state = connection_reading;
+    connection->readable = 0;
+    connection->writable = 1;
+    connection->length = 0;
+    connection->request_length = 0;
+    http_parser_init(&connection->parser);
+    connection->keep_alive = 0;
+    connection->peer_closed = 0;
+    connection->requests = 0;
+    connection->last_active = 0;
+    connection->out = NULL;
+    connection->out_length = connection->out_sent = 0;
+    connection->file_fd = -1;
+    connection->parts = NULL;
+    connection->part_count = connection->part_index = 0;
+    connection->part_sent = 0;
+    connection->stream = NULL;
+    upload_init(&connection->upload);
+    arena_init(&connection->arena);
+    connection->next = NULL;
+    connection->idle_prev = connection->idle_next = NULL;
+    connection->reactor = NULL;
+    return connection;
+}
+
+void connection_free(struct Connection *connection)
+{
+    if (connection == NULL)
+    {
+        return;
+    }
+    if (connection->file_fd != -1)
+    {
+        close(connection->file_fd);
+        connection->file_fd = -1;
+    }
+    if (connection->upload.state != upload_idle)
+    {
+        upload_abort(&connection->upload);
+    }
+    if (connection->stream != NULL)
+    {
+        stream_free(connection);
+    }
+    arena_destroy(&connection->arena);
+    slab_free(connection_slab, connection);
+}
+
+int connection_send(struct Connection *connection, const char *data, size_t length)
+{
+    struct iovec iov = {(void *)data, length};
+    return connection_sendv(connection, &iov, 1);
+}
+
+static int connection_sendv_flags(struct Connection *connection, const struct iovec *iov, int iovcnt, int flags)
+{
+    size_t length = 0, sent = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        length += iov[i].iov_len;
+    }
+
+    /* Keep ordering: never write past output that is still queued */
+    while (connection->out_sent == connection->out_length && sent < length)
+    {
+        struct iovec remaining[IOV_MAX];
+        struct msghdr msg = {0};
+        size_t skip = sent;
+        int i = 0;
+
+        /* Drop the iovecs a short write already covered */
+        while (skip >= iov[i].iov_len)
+        {
+            skip -= iov[i++].iov_len;
+        }
+        for (msg.msg_iovlen = 0; i < iovcnt && msg.msg_iovlen < IOV_MAX; i++, msg.msg_iovlen++)
+        {
+            remaining[msg.msg_iovlen].iov_base = (char *)iov[i].iov_base + skip;
+            remaining[msg.msg_iovlen].iov_len = iov[i].iov_len - skip;
+            skip = 0;
+        }
+        msg.msg_iov = remaining;
+
+        ssize_t n = sendmsg(connection->client_fd, &msg, MSG_NOSIGNAL | flags);
+        if (n >= 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            connection->writable = 0;
+            break;
+        }
+        return -1;
+    }
+
+    if (sent == length)
+    {
+        return 0;
+    }
+
+    /* Queue the remainder for the reactor */
+    size_t pending = connection->out_length - connection->out_sent;
+    char *out = (char *)arena_alloc(&connection->arena, pending + length - sent);
+    if (out == NULL)
+    {
+        return -1;
+    }
+    memcpy(out, connection->out + connection->out_sent, pending);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (sent >= iov[i].iov_len)
+        {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(out + pending, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        pending += iov[i].iov_len - sent;
+        sent = 0;
+    }
+    connection->out = out;
+    connection->out_length = pending;
+    connection->out_sent = 0;
+    return 0;
+}
+
+int connection_sendv(struct Connection *connection, const struct iovec *iov, int iovcnt)
+{
+    return connection_sendv_flags(connection, iov, iovcnt, 0);
+}
+
+int connection_sendfile(struct Connection *connection, const struct iovec *iov, int iovcnt, int fd, const connection_part_t *parts, int part_count)
+{
+    size_t text = 0;
+    for (int i = 0; i < part_count; i++)
+    {
+        text += parts[i].data ? parts[i].length : 0;
+    }
+
+    /* Parts are only ever queued last, the reactor drains them before the next request */
+    if (connection_sendv_flags(connection, iov, iovcnt, part_count ? MSG_MORE : 0) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (part_count == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    connection->parts = (connection_part_t *)arena_alloc(&connection->arena, sizeof(connection_part_t) * part_count + text);
+    if (connection->parts == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    char *copy = (char *)(connection->parts + part_count);
+    for (int i = 0; i < part_count; i++)
+    {
+        connection->parts[i] = parts[i];
+        if (parts[i].data)
+        {
+            memcpy(copy, parts[i].data, parts[i].length);
+            connection->parts[i].data = copy;
+            copy += parts[i].length;
+        }
+    }
+    connection->file_fd = fd;
+    connection->part_count = part_count;
+    connection->part_index = 0;
+    connection->part_sent = 0;
+    return connection_flush(connection) < 0 ? -1 : 0;
+}
+
+int connection_sendstream(struct Connection *connection, const struct iovec *iov, int iovcnt, int fd, const encoder_t *encoder)
+{
+    if (connection_sendv_flags(connection, iov, iovcnt, MSG_MORE) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    connection_stream_t *stream = (connection_stream_t *)malloc(sizeof(connection_stream_t));
+    if (stream == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    stream->encoder = encoding_stream_create(encoder);
+    if (stream->encoder == NULL)
+    {
+        free(stream);
+        close(fd);
+        return -1;
+    }
+    stream->input = stream->window;
+    stream->input_length = 0;
+    stream->eof = stream->done = 0;
+    stream->frame_start = stream->frame_length = stream->frame_sent = 0;
+    connection->stream = stream;
+    connection->file_fd = fd;
+    return connection_flush(connection) < 0 ? -1 : 0;
+}
+
+/* Encodes until there is output, then frames it as the next chunk */
+static int stream_next(struct Connection *connection)
+{
+    connection_stream_t *stream = connection->stream;
+    char *data = stream->frame + CHUNK_HEAD;
+    size_t produced = 0;
+
+    while (produced == 0 && !stream->done)
+    {
+        if (stream->input_length == 0 && !stream->eof)
+        {
+            ssize_t n = read(connection->file_fd, stream->window, sizeof(stream->window));
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            stream->input = stream->window;
+            stream->input_length = n;
+            stream->eof = n == 0;
+        }
+
+        produced = CONNECTION_STREAM_WINDOW;
+        int status = encoding_stream_write(stream->encoder, &stream->input, &stream->input_length, data, &produced, stream->eof);
+        if (status < 0)
+        {
+            return -1;
+        }
+        stream->done = status;
+    }
+
+    /* A zero-size chunk would end the body, so empty output only carries the last chunk */
+    size_t length = 0;
+    if (produced > 0)
+    {
+        char head[CHUNK_HEAD];
+        int n = snprintf(head, sizeof(head), "%zx\r\n", produced);
+        stream->frame_start = CHUNK_HEAD - n;
+        memcpy(stream->frame + stream->frame_start, head, n);
+        memcpy(data + produced, "\r\n", 2);
+        length = n + produced + 2;
+    }
+    else
+    {
+        stream->frame_start = CHUNK_HEAD;
+    }
+    if (stream->done)
+    {
+        memcpy(stream->frame + stream->frame_start + length, CHUNK_LAST, sizeof(CHUNK_LAST) - 1);
+        length += sizeof(CHUNK_LAST) - 1;
+    }
+    stream->frame_length = length;
+    stream->frame_sent = 0;
+    return 0;
+}
+
+static int stream_flush(struct Connection *connection)
+{
+    connection_stream_t *stream = connection->stream;
+    int encoded = 0;
+
+    for (;;)
+    {
+        if (stream->frame_sent == stream->frame_length)
+        {
+            if (stream->done)
+            {
+                stream_free(connection);
+                return 1;
+            }
+            /* Reading and compressing is the expensive part, one fast client must not hog the thread */
+            if (encoded == CONNECTION_STREAM_BUDGET)
+            {
+                return 0;
+            }
+            if (stream_next(connection) != 0)
+            {
+                return -1;
+            }
+            encoded++;
+            continue;
+        }
+
+        ssize_t n = send(connection->client_fd,
+                         stream->frame + stream->frame_start + stream->frame_sent,
+                         stream->frame_length - stream->frame_sent,
+                         MSG_NOSIGNAL | (stream->done ? 0 : MSG_MORE));
+        if (n >= 0)
+        {
+            stream->frame_sent += n;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            connection->writable = 0;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+int connection_flush(struct Connection *connection)
+{
+    int more = (connection->part_count || connection->stream) ? MSG_MORE : 0;
+
+    while (connection->out_sent < connection->out_length)
+    {
+        ssize_t n = send(connection->client_fd,
+                         connection->out + connection->out_sent,
+                         connection->out_length - connection->out_sent,
+                         MSG_NOSIGNAL | more);
+        if (n >= 0)
+        {
+            connection->out_sent += n;
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            connection->writable = 0;
+            return 0;
+        }
+        return -1;
+    }
+
+    connection->out = NULL;
+    connection->out_length = connection->out_sent = 0;
+
+    if (connection->stream != NULL)
+    {
+        return stream_flush(connection);
+    }
+
+    while (connection->part_index < connection->part_count)
+    {
+        const connection_part_t *part = &connection->parts[connection->part_index];
+        size_t remaining = part->length - connection->part_sent;
+        ssize_t n;
+
+        if (part->data)
+        {
+            more = connection->part_index + 1 < connection->part_count ? MSG_MORE : 0;
+            n = send(connection->client_fd, part->data + connection->part_sent, remaining, MSG_NOSIGNAL | more);
+        }
+        else
+        {
+            /* Linux moves at most 0x7ffff000 bytes per call */
+            off_t offset = part->offset + connection->part_sent;
+            n = sendfile(connection->client_fd, connection->file_fd, &offset,
+                         remaining > 0x7ffff000 ? 0x7ffff000 : remaining);
+        }
+        if (n > 0)
+        {
+            connection->part_sent += n;
+            if (connection->part_sent == part->length)
+            {
+                connection->part_index++;
+                connection->part_sent = 0;
+            }
+            continue;
+        }
+        if (n == 0)
+        {
+            /* The file shrank under us, the promised Content-Length cannot be met */
+            return -1;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            connection->writable = 0;
+            return 0;
+        }
+        return -1;
+    }
+    if (connection->file_fd != -1)
+    {
+        close(connection->file_fd);
+        connection->file_fd = -1;
+    }
+    connection->parts = NULL;
+    connection->part_count = connection->part_index = 0;
+    return 1;
+}
@@ -0,0 +1,201 @@
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "parser.h"
+#include "upload.h"
+#include "encoding.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file connection.h
+     * @brief Per-client connection state shared by the reactor and workers
+     */
+
+#define CONNECTION_BUFFER_SIZE 8192
+#define CONNECTION_STREAM_WINDOW (32 * 1024) // file bytes read per encoded chunk
+#define CONNECTION_STREAM_BUDGET 1           // windows encoded per flush before other connections get a turn
+
+    typedef enum
+    {
+        connection_reading = 0,    /* owned by the reactor, waiting for a request */
+        connection_processing = 1, /* owned by a worker thread */
+        connection_writing = 2,    /* owned by the reactor, flushing output */
+        connection_closed = 3,
+        connection_receiving = 4,  /* owned by the reactor, streaming a body into upload */
+        connection_deferred = 5    /* owned by the reactor, a stream waiting for its next turn */
+    } connection_state_t;
+
+    struct reactor_t;
+    struct connection_stream_t;
+
+    /**
+     *  @struct connection_part_t
+     *  @brief A piece of a response body: length bytes of data, or of the
+     *         connection's file from offset when data is NULL
+     */
+    typedef struct
+    {
+        const char *data;
+        off_t offset;
+        size_t length;
+    } connection_part_t;
+
+    /**
+     *  @struct Connection
+     *  @brief A nonblocking client socket and its buffers
+     *
+     *  @var client_addr    Peer address.
+     *  @var client_fd      Nonblocking socket.
+     *  @var state          Which side currently owns the connection.
+     *  @var readable       Edge-triggered EPOLLIN seen and not yet drained.
+     *  @var writable       Edge-triggered EPOLLOUT seen since the last EAGAIN.
+     *  @var length         Bytes received into buffer.
+     *  @var request_length Bytes of buffer making up the framed request.
+     *  @var parser         Parse state of the request at the start of buffer.
+     *  @var keep_alive     Set by the worker when the socket may be reused.
+     *  @var peer_closed    The client shut down its side of the socket.
+     *  @var requests       Responses completed on this socket.
+     *  @var last_active    Monotonic milliseconds of the last socket progress.
+     *  @var out            Output the socket could not take yet.
+     *  @var file_fd        File the parts read from, -1 if none.
+     *  @var parts          Body parts that follow out, in one allocation
+     *                      with copies of their in-memory data.
+     *  @var part_index     Part being sent.
+     *  @var part_sent      Bytes of that part already sent.
+     *  @var stream         file_fd encoded and sent as chunks, NULL if none.
+     *  @var upload         Body being streamed to a file, set up by a worker.
+     *  @var arena          Memory for out, parts and upload, reset when the
+     *                      next request starts.
+     *  @var next           Link for the reactor's completion and close lists.
+     *  @var idle_prev      Reactor idle list, ordered by last_active.
+     */
+    struct Connection
+    {
+        struct sockaddr_in client_addr;
+        int client_fd;
+        connection_state_t state;
+        int readable;
+        int writable;
+        size_t length;
+        size_t request_length;
+        http_parser_t parser;
+        int keep_alive;
+        int peer_closed;
+        int requests;
+        long long last_active;
+        char *out;
+        size_t out_length;
+        size_t out_sent;
+        int file_fd;
+        connection_part_t *parts;
+        int part_count;
+        int part_index;
+        size_t part_sent;
+        struct connection_stream_t *stream;
+        upload_t upload;
+        arena_t arena;
+        struct Connection *next;
+        struct Connection *idle_prev;
+        struct Connection *idle_next;
+        struct reactor_t *reactor;
+        char buffer[CONNECTION_BUFFER_SIZE + 1];
+    };
+
+    /**
+     * @function connection_pool_init
+     * @brief Preallocates room for capacity connections. Call once before
+     *        the first connection_create().
+     * @return 0 on success, -1 on allocation failure
+     */
+    int connection_pool_init(size_t capacity);
+
+    /**
+     * @function connection_pool_bytes
+     * @brief Memory reserved for connections.
+     */
+    size_t connection_pool_bytes(void);
+
+    /**
+     * @function connection_pool_destroy
+     * @brief Releases the pool. Every connection must have been freed.
+     */
+    void connection_pool_destroy(void);
+
+    /**
+     * @function connection_create
+     * @brief Takes a connection from the pool for an accepted socket.
+     * @return a new connection, or NULL with errno set to EMFILE when the
+     * pool is exhausted
+     */
+    struct Connection *connection_create(int client_fd, const struct sockaddr_in *client_addr);
+
+    /**
+     * @function connection_free
+     * @brief Returns a connection to the pool. The socket must already be
+     *        closed.
+     */
+    void connection_free(struct Connection *connection);
+
+    /**
+     * @function connection_send
+     * @brief Writes as much as the socket takes and queues the rest.
+     * @return 0 on success, -1 if the peer is gone
+     */
+    int connection_send(struct Connection *connection, const char *data, size_t length);
+
+    /**
+     * @function connection_sendv
+     * @brief Gathers iovcnt buffers into as few writes as the socket allows
+     *        and queues the rest.
+     * @return 0 on success, -1 if the peer is gone
+     */
+    int connection_sendv(struct Connection *connection, const struct iovec *iov, int iovcnt);
+
+    /**
+     * @function connection_sendfile
+     * @brief Sends iovcnt header buffers followed by part_count body parts
+     *        read from fd or memory. Everything but the last piece goes out
+     *        with MSG_MORE so headers share a segment with the start of the
+     *        body, which the kernel copies straight from the page cache.
+     *        Whatever the socket does not take is finished by
+     *        connection_flush(). Takes ownership of fd.
+     * @return 0 on success, -1 if the peer is gone
+     */
+    int connection_sendfile(struct Connection *connection, const struct iovec *iov, int iovcnt, int fd, const connection_part_t *parts, int part_count);
+
+    /**
+     * @function connection_sendstream
+     * @brief Sends iovcnt header buffers followed by all of fd, encoded
+     *        with encoder and framed with chunked transfer coding. The file
+     *        is read and encoded one CONNECTION_STREAM_WINDOW at a time as
+     *        the socket drains, so memory stays bounded and the first chunk
+     *        does not wait for the rest. Takes ownership of fd.
+     * @return 0 on success, -1 if the peer is gone
+     */
+    int connection_sendstream(struct Connection *connection, const struct iovec *iov, int iovcnt, int fd, const encoder_t *encoder);
+
+    /**
+     * @function connection_flush
+     * @brief Writes queued output, then the rest of a pending file or stream.
+     *        A stream encodes at most CONNECTION_STREAM_BUDGET windows per
+     *        call and then returns 0 with writable still set, the caller
+     *        has to come back without waiting for the socket.
+     * @return 1 when everything is sent, 0 on EAGAIN or a yield, -1 on error
+     */
+    int connection_flush(struct Connection *connection);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CONNECTION_H_ */
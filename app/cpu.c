@@ -0,0 +1,116 @@
+/**
+ * @file cpu.c
+ * @brief Processor count and thread placement
+ */
+
+#define _GNU_SOURCE // cpu_set_t, sched_getaffinity, pthread_setaffinity_np
+
+#include <errno.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/* Quota divided by period, rounded up, or 0 when there is no limit */
+static int cgroup_quota(void)
+{
+    long long quota = -1;
+    long long period = 0;
+    char limit[32];
+
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (file != NULL)
+    {
+        /* "max 100000" or "400000 100000" */
+        if (fscanf(file, "%31s %lld", limit, &period) == 2 && limit[0] != 'm')
+        {
+            sscanf(limit, "%lld", &quota);
+        }
+        fclose(file);
+    }
+    else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL)
+    {
+        if (fscanf(file, "%lld", &quota) != 1)
+        {
+            quota = -1;
+        }
+        fclose(file);
+        if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL)
+        {
+            if (fscanf(file, "%lld", &period) != 1)
+            {
+                period = 0;
+            }
+            fclose(file);
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+    {
+        return 0;
+    }
+    return (int)((quota + period - 1) / period);
+}
+
+int cpu_count(void)
+{
+    cpu_set_t set;
+    long count;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        count = CPU_COUNT(&set);
+    }
+    else
+    {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    int quota = cgroup_quota();
+    if (quota > 0 && quota < count)
+    {
+        count = quota;
+    }
+    return count > 0 ? (int)count : 1;
+}
+
+int cpu_list(int *cpus, int max)
+{
+    cpu_set_t set;
+    int count = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus[count++] = cpu;
+            }
+        }
+    }
+    if (count == 0 && max > 0)
+    {
+        cpus[count++] = 0;
+    }
+    return count;
+}
+
+int cpu_pin(int cpu)
+{
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
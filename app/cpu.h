@@ -0,0 +1,51 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file cpu.h
+     * @brief Processor count and thread placement
+     *
+     * A container usually sees every processor of the host in /proc and
+     * sysconf(), while its affinity mask and cgroup CPU quota decide how
+     * much it may actually use. Sizing thread counts from the latter keeps
+     * a 4 CPU pod on a 64 core host from running 64 threads that mostly
+     * wait for each other to be descheduled.
+     */
+
+#define CPU_MAX 1024
+
+    /**
+     * @function cpu_count
+     * @brief Processors the process may use: the affinity mask, capped by
+     *        the cgroup quota (cgroup v2 cpu.max or v1 cfs_quota_us)
+     *        rounded up.
+     * @return at least 1
+     */
+    int cpu_count(void);
+
+    /**
+     * @function cpu_list
+     * @brief Ids of the processors in the affinity mask, lowest first.
+     * @return number of ids stored, at most max and at least 1
+     */
+    int cpu_list(int *cpus, int max);
+
+    /**
+     * @function cpu_pin
+     * @brief Restricts the calling thread to one processor. Memory the
+     *        thread touches first afterwards comes from that processor's
+     *        NUMA node under the default first-touch policy.
+     * @return 0 on success, -1 with errno set otherwise
+     */
+    int cpu_pin(int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CPU_H_ */
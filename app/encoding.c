@@ -0,0 +1,400 @@
+/**
+ * @file encoding.c
+ * @brief Content-coding negotiation and response body encoders
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tinycthread.h"
+#include "encoding.h"
+
+#define Q_MAX 1000 // q-values are kept in thousandths
+#define Q_UNSET -1
+
+/**
+ *  @struct encoding_context_t
+ *  @brief One worker's compression state, created on first use
+ *
+ *  @var zlib   gzip and deflate streams, 256KB or so each once initialised.
+ *  @var ready  Which zlib streams have been through deflateInit2.
+ */
+typedef struct
+{
+    z_stream zlib[2];
+    int ready[2];
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} encoding_context_t;
+
+static tss_t context_key;
+static int zlib_level = Z_DEFAULT_COMPRESSION;
+
+static void context_free(void *arg)
+{
+    encoding_context_t *context = (encoding_context_t *)arg;
+    for (int i = 0; i < 2; i++)
+    {
+        if (context->ready[i])
+        {
+            deflateEnd(&context->zlib[i]);
+        }
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(context->zstd);
+#endif
+    free(context);
+}
+
+static encoding_context_t *context_get(void)
+{
+    encoding_context_t *context = (encoding_context_t *)tss_get(context_key);
+    if (context != NULL)
+    {
+        return context;
+    }
+    context = (encoding_context_t *)calloc(1, sizeof(encoding_context_t));
+    if (context == NULL)
+    {
+        return NULL;
+    }
+    if (tss_set(context_key, context) != thrd_success)
+    {
+        free(context);
+        return NULL;
+    }
+    return context;
+}
+
+/* window_bits picks the wrapper: 15 | 16 for gzip, 15 for the zlib format HTTP calls deflate */
+static int zlib_compress(int slot, int window_bits, const char *input, size_t length, char *output, size_t size)
+{
+    encoding_context_t *context = context_get();
+    if (context == NULL)
+    {
+        return -1;
+    }
+
+    z_stream *zs = &context->zlib[slot];
+    if (!context->ready[slot])
+    {
+        if (deflateInit2(zs, zlib_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return -1;
+        }
+        context->ready[slot] = 1;
+    }
+    else if (deflateReset(zs) != Z_OK)
+    {
+        return -1;
+    }
+
+    zs->next_in = (Bytef *)input;
+    zs->avail_in = (uInt)length;
+    zs->next_out = (Bytef *)output;
+    zs->avail_out = (uInt)size;
+
+    /* Output that does not fit is an error, not a truncated body */
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+    {
+        return -1;
+    }
+    return (int)zs->total_out;
+}
+
+static int gzip_compress(const char *input, size_t length, char *output, size_t size)
+{
+    return zlib_compress(0, 15 | 16, input, length, output, size);
+}
+
+static int deflate_compress(const char *input, size_t length, char *output, size_t size)
+{
+    return zlib_compress(1, 15, input, length, output, size);
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_compress(const char *input, size_t length, char *output, size_t size)
+{
+    encoding_context_t *context = context_get();
+    if (context == NULL)
+    {
+        return -1;
+    }
+    if (context->zstd == NULL && (context->zstd = ZSTD_createCCtx()) == NULL)
+    {
+        return -1;
+    }
+
+    size_t n = ZSTD_compressCCtx(context->zstd, output, size, input, length, ENCODING_ZSTD_LEVEL);
+    return ZSTD_isError(n) ? -1 : (int)n;
+}
+#endif
+
+/**
+ *  @struct encoding_stream_t
+ *  @brief An encode spread over many calls
+ */
+struct encoding_stream_t
+{
+    const encoder_t *encoder;
+    z_stream zlib;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+/* Server preference order, used to break q-value ties */
+static const encoder_t encoders[] = {
+#ifdef HAVE_ZSTD
+    {encoding_zstd, "zstd", "Content-Encoding: zstd\r\n", zstd_compress},
+#endif
+    {encoding_gzip, "gzip", "Content-Encoding: gzip\r\n", gzip_compress},
+    {encoding_deflate, "deflate", "Content-Encoding: deflate\r\n", deflate_compress},
+};
+
+#define ENCODER_COUNT (int)(sizeof(encoders) / sizeof(encoders[0]))
+
+int encoding_init(int level)
+{
+    zlib_level = level;
+    return tss_create(&context_key, context_free) == thrd_success ? 0 : -1;
+}
+
+void encoding_destroy(void)
+{
+    tss_delete(context_key);
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ) */
+static int parse_q(const char *p, const char *end)
+{
+    if (p == end || (*p != '0' && *p != '1'))
+    {
+        return Q_UNSET;
+    }
+    int q = (*p++ - '0') * Q_MAX;
+    if (p < end && *p == '.')
+    {
+        p++;
+        for (int scale = 100; p < end && *p >= '0' && *p <= '9' && scale > 0; scale /= 10)
+        {
+            q += (*p++ - '0') * scale;
+        }
+    }
+    return (p == end && q <= Q_MAX) ? q : Q_UNSET;
+}
+
+static int token_is(const char *token, size_t length, const char *name)
+{
+    return strlen(name) == length && strncasecmp(token, name, length) == 0;
+}
+
+const encoder_t *encoding_negotiate(http_string_t accept_encoding, unsigned offered)
+{
+    int q[ENCODER_COUNT];
+    int star = Q_UNSET, identity = Q_UNSET;
+    const char *p = accept_encoding.data, *end = p + accept_encoding.length;
+
+    if (p == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < ENCODER_COUNT; i++)
+    {
+        q[i] = Q_UNSET;
+    }
+
+    while (p < end)
+    {
+        /* One element: coding *( OWS ";" OWS param ) */
+        const char *element_end = memchr(p, ',', end - p);
+        if (element_end == NULL)
+        {
+            element_end = end;
+        }
+        while (p < element_end && is_space(*p))
+        {
+            p++;
+        }
+        const char *token = p;
+        while (p < element_end && *p != ';' && !is_space(*p))
+        {
+            p++;
+        }
+        size_t token_length = p - token;
+
+        int weight = Q_MAX;
+        while (p < element_end)
+        {
+            const char *param = memchr(p, ';', element_end - p);
+            if (param == NULL)
+            {
+                break;
+            }
+            p = param + 1;
+            while (p < element_end && is_space(*p))
+            {
+                p++;
+            }
+            if (element_end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=')
+            {
+                const char *value_end = p + 2;
+                while (value_end < element_end && *value_end != ';' && !is_space(*value_end))
+                {
+                    value_end++;
+                }
+                weight = parse_q(p + 2, value_end);
+                p = value_end;
+            }
+        }
+        p = element_end + 1;
+
+        /* Malformed q-values drop the element */
+        if (token_length == 0 || weight == Q_UNSET)
+        {
+            continue;
+        }
+        if (token_is(token, token_length, "*"))
+        {
+            star = weight;
+        }
+        else if (token_is(token, token_length, "identity"))
+        {
+            identity = weight;
+        }
+        else
+        {
+            for (int i = 0; i < ENCODER_COUNT; i++)
+            {
+                if (token_is(token, token_length, encoders[i].name) ||
+                    (encoders[i].id == encoding_gzip && token_is(token, token_length, "x-gzip")))
+                {
+                    q[i] = weight;
+                }
+            }
+        }
+    }
+
+    /* Unlisted codings take the "*" weight */
+    const encoder_t *best = NULL;
+    int best_q = 0;
+    for (int i = 0; i < ENCODER_COUNT; i++)
+    {
+        int weight = q[i] != Q_UNSET ? q[i] : (star != Q_UNSET ? star : 0);
+        if ((encoders[i].id & offered) && weight > best_q)
+        {
+            best = &encoders[i];
+            best_q = weight;
+        }
+    }
+    /* Identity only competes when the client weighed it, directly or through "*" */
+    if (identity == Q_UNSET)
+    {
+        identity = star;
+    }
+    if (best != NULL && best_q < identity)
+    {
+        return NULL;
+    }
+    return best;
+}
+
+encoding_stream_t *encoding_stream_create(const encoder_t *encoder)
+{
+    encoding_stream_t *stream = (encoding_stream_t *)calloc(1, sizeof(encoding_stream_t));
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+    stream->encoder = encoder;
+
+#ifdef HAVE_ZSTD
+    if (encoder->id == encoding_zstd)
+    {
+        stream->zstd = ZSTD_createCCtx();
+        if (stream->zstd == NULL ||
+            ZSTD_isError(ZSTD_CCtx_setParameter(stream->zstd, ZSTD_c_compressionLevel, ENCODING_ZSTD_LEVEL)))
+        {
+            ZSTD_freeCCtx(stream->zstd);
+            free(stream);
+            return NULL;
+        }
+        return stream;
+    }
+#endif
+
+    int window_bits = encoder->id == encoding_gzip ? 15 | 16 : 15;
+    if (deflateInit2(&stream->zlib, zlib_level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int encoding_stream_write(encoding_stream_t *stream, const char **input, size_t *input_length,
+                          char *output, size_t *output_length, int finish)
+{
+#ifdef HAVE_ZSTD
+    if (stream->encoder->id == encoding_zstd)
+    {
+        ZSTD_inBuffer in = {*input, *input_length, 0};
+        ZSTD_outBuffer out = {output, *output_length, 0};
+        size_t left = ZSTD_compressStream2(stream->zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left))
+        {
+            return -1;
+        }
+        *input += in.pos;
+        *input_length -= in.pos;
+        *output_length = out.pos;
+        return finish && *input_length == 0 && left == 0;
+    }
+#endif
+
+    z_stream *zs = &stream->zlib;
+    zs->next_in = (Bytef *)*input;
+    zs->avail_in = (uInt)*input_length;
+    zs->next_out = (Bytef *)output;
+    zs->avail_out = (uInt)*output_length;
+
+    int status = deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+    {
+        return -1;
+    }
+    *input += *input_length - zs->avail_in;
+    *input_length = zs->avail_in;
+    *output_length -= zs->avail_out;
+    return status == Z_STREAM_END;
+}
+
+void encoding_stream_destroy(encoding_stream_t *stream)
+{
+    if (stream == NULL)
+    {
+        return;
+    }
+#ifdef HAVE_ZSTD
+    if (stream->encoder->id == encoding_zstd)
+    {
+        ZSTD_freeCCtx(stream->zstd);
+        free(stream);
+        return;
+    }
+#endif
+    deflateEnd(&stream->zlib);
+    free(stream);
+}
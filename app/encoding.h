@@ -0,0 +1,112 @@
+#ifndef _ENCODING_H_
+#define _ENCODING_H_
+
+#include <stddef.h>
+
+#include "parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file encoding.h
+     * @brief Content-coding negotiation and response body encoders
+     *
+     * encoding_negotiate() ranks the codings in an Accept-Encoding value by
+     * their q-values and picks the registered encoder the client likes best,
+     * breaking ties by server preference: zstd, then gzip, then deflate.
+     * zstd is only registered when built with HAVE_ZSTD. Encoders keep one
+     * compression context per worker thread and reset it between bodies.
+     * Large bodies use an encoding_stream_t instead, which is fed one
+     * window at a time and needs no knowledge of the total size.
+     */
+
+#define ENCODING_ZSTD_LEVEL 3
+
+    typedef enum
+    {
+        encoding_gzip = 1 << 0,
+        encoding_deflate = 1 << 1,
+        encoding_zstd = 1 << 2
+    } encoding_t;
+
+#define ENCODING_ANY (encoding_gzip | encoding_deflate | encoding_zstd)
+
+    /**
+     *  @struct encoder_t
+     *  @brief A registered content-coding
+     *
+     *  @var id        Bit used to restrict negotiation.
+     *  @var name      Token as it appears in Accept-Encoding.
+     *  @var header    Content-Encoding header line, CRLF included.
+     *  @var compress  Encodes length bytes of input into output, returning
+     *                 the encoded length, or -1 on error or when size is
+     *                 too small.
+     */
+    typedef struct
+    {
+        encoding_t id;
+        const char *name;
+        const char *header;
+        int (*compress)(const char *input, size_t length, char *output, size_t size);
+    } encoder_t;
+
+    /**
+     * @function encoding_init
+     * @brief Sets the zlib level for gzip and deflate and creates the
+     *        per-thread context slot. Call once before any worker starts.
+     * @return 0 on success, -1 on failure
+     */
+    int encoding_init(int level);
+
+    /**
+     * @function encoding_negotiate
+     * @brief Chooses among the encoders in offered for an Accept-Encoding
+     *        value. Codings with q=0 are never chosen and identity wins
+     *        when the client ranks it strictly higher.
+     * @return the encoder, or NULL to send the body as is
+     */
+    const encoder_t *encoding_negotiate(http_string_t accept_encoding, unsigned offered);
+
+    typedef struct encoding_stream_t encoding_stream_t;
+
+    /**
+     * @function encoding_stream_create
+     * @brief Starts an incremental encode for bodies too large to encode
+     *        in one call. Each stream owns its compressor state.
+     * @return the stream, or NULL on allocation failure
+     */
+    encoding_stream_t *encoding_stream_create(const encoder_t *encoder);
+
+    /**
+     * @function encoding_stream_write
+     * @brief Encodes from *input into the *output_length bytes of output,
+     *        advancing *input and *input_length past what was consumed and
+     *        setting *output_length to the bytes produced. Set finish once
+     *        the last input has been passed in, and keep calling until done.
+     * @return 1 when the encoded stream is complete, 0 when more input or
+     * output room is needed, -1 on error
+     */
+    int encoding_stream_write(encoding_stream_t *stream, const char **input, size_t *input_length,
+                              char *output, size_t *output_length, int finish);
+
+    /**
+     * @function encoding_stream_destroy
+     * @brief Frees a stream, finished or not.
+     */
+    void encoding_stream_destroy(encoding_stream_t *stream);
+
+    /**
+     * @function encoding_destroy
+     * @brief Deletes the context slot. Worker threads free their own
+     *        contexts when they exit.
+     */
+    void encoding_destroy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ENCODING_H_ */
@@ -0,0 +1,683 @@
+/**
+ * @file file_cache.c
+ * @brief Sharded in-memory cache of small static files
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "file_cache.h"
+#include "tinycthread.h"
+
+typedef enum
+{
+    entry_ready = 0,   /* data holds the representation */
+    entry_pending = 1, /* a gzip variant is being compressed */
+    entry_skip = 2,    /* no gzip variant worth keeping, send the file as is */
+    entry_oversize = 3 /* larger than max_entry, the caller opens it itself */
+} entry_status_t;
+
+/**
+ *  @struct cache_entry_t
+ *  @brief A file_entry_t with its bookkeeping, path, headers and data
+ *         share one allocation
+ *
+ *  @var file       Public view, first so the two convert by cast.
+ *  @var chain      Next entry in the same bucket.
+ *  @var lru_prev   Towards the most recently used entry.
+ *  @var encoding   Representation, part of the key with path.
+ *  @var status     Whether data can be served.
+ *  @var sibling    The gzip data came from path.gz rather than compression.
+ *  @var refs       Outstanding file_cache_get() references.
+ *  @var linked     Still reachable from the table. Unlinked entries are
+ *                  freed by their last release.
+ *  @var validated  Monotonic milliseconds of the last stat check.
+ *  @var mtime      Identity of the file the entry was made from.
+ *  @var cost       Bytes charged against the shard budget.
+ */
+typedef struct cache_entry_t
+{
+    file_entry_t file;
+    struct cache_entry_t *chain;
+    struct cache_entry_t *lru_prev;
+    struct cache_entry_t *lru_next;
+    uint32_t hash;
+    file_encoding_t encoding;
+    entry_status_t status;
+    int sibling;
+    int refs;
+    int linked;
+    long long validated;
+    struct timespec mtime;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    size_t cost;
+    char path[];
+} cache_entry_t;
+
+typedef struct
+{
+    mtx_t lock;
+    cache_entry_t *buckets[FILE_CACHE_BUCKETS];
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t bytes;
+    size_t capacity;
+} cache_shard_t;
+
+struct file_cache_t
+{
+    cache_shard_t shards[FILE_CACHE_SHARDS];
+    size_t max_entry;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t path_hash(const char *path, file_encoding_t encoding)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path; path++)
+    {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return (hash ^ (uint32_t)encoding) * 16777619u;
+}
+
+static cache_shard_t *shard_of(file_cache_t *cache, uint32_t hash)
+{
+    return &cache->shards[hash % FILE_CACHE_SHARDS];
+}
+
+static cache_entry_t **bucket_of(cache_shard_t *shard, uint32_t hash)
+{
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+}
+
+static int same_file(const cache_entry_t *entry, const struct stat *st)
+{
+    return entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           entry->dev == st->st_dev &&
+           entry->ino == st->st_ino;
+}
+
+static int same_version(const cache_entry_t *a, const cache_entry_t *b)
+{
+    return a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec &&
+           a->dev == b->dev &&
+           a->ino == b->ino;
+}
+
+/* The file an entry has to be checked against */
+static int entry_stat(const cache_entry_t *entry, struct stat *st)
+{
+    char sibling[PATH_MAX];
+    if (!entry->sibling)
+    {
+        return stat(entry->path, st);
+    }
+    if (snprintf(sibling, sizeof(sibling), "%s.gz", entry->path) >= (int)sizeof(sibling))
+    {
+        return -1;
+    }
+    return stat(sibling, st);
+}
+
+/* A path.gz that showed up takes over from a variant made or skipped without one */
+static int sibling_appeared(const cache_entry_t *entry)
+{
+    char sibling[PATH_MAX];
+    struct stat st;
+    if (entry->encoding != file_gzip || entry->sibling)
+    {
+        return 0;
+    }
+    if (snprintf(sibling, sizeof(sibling), "%s.gz", entry->path) >= (int)sizeof(sibling))
+    {
+        return 0;
+    }
+    return stat(sibling, &st) == 0;
+}
+
+static void lru_unlink(cache_shard_t *shard, cache_entry_t *entry)
+{
+    if (entry->lru_prev)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(cache_shard_t *shard, cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head)
+    {
+        shard->lru_head->lru_prev = entry;
+    }
+    else
+    {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+/* Caller holds the shard lock */
+static cache_entry_t *shard_find(cache_shard_t *shard, uint32_t hash, file_encoding_t encoding, const char *path)
+{
+    for (cache_entry_t *entry = *bucket_of(shard, hash); entry; entry = entry->chain)
+    {
+        if (entry->hash == hash && entry->encoding == encoding && strcmp(entry->path, path) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Caller holds the shard lock */
+static void shard_unlink(cache_shard_t *shard, cache_entry_t *entry)
+{
+    cache_entry_t **link = bucket_of(shard, entry->hash);
+    while (*link != entry)
+    {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    lru_unlink(shard, entry);
+    shard->bytes -= entry->cost;
+    entry->linked = 0;
+    if (entry->refs == 0)
+    {
+        free(entry);
+    }
+}
+
+/* Caller holds the shard lock. Replaces any entry with the same key. */
+static void shard_insert(cache_shard_t *shard, cache_entry_t *entry)
+{
+    cache_entry_t *old = shard_find(shard, entry->hash, entry->encoding, entry->path);
+    if (old != NULL)
+    {
+        shard_unlink(shard, old);
+    }
+
+    cache_entry_t **bucket = bucket_of(shard, entry->hash);
+    entry->chain = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->bytes += entry->cost;
+
+    /* Referenced victims stay alive until their last release */
+    while (shard->bytes > shard->capacity && shard->lru_tail != entry)
+    {
+        shard_unlink(shard, shard->lru_tail);
+    }
+}
+
+/* One allocation for the entry, its key, headers and size bytes of data */
+static cache_entry_t *entry_create(const char *path, uint32_t hash, file_encoding_t encoding,
+                                   const struct stat *st, size_t size, size_t capacity)
+{
+    char etag[FILE_ETAG_SIZE];
+    char headers[256];
+    int headers_length;
+    size_t path_length = strlen(path);
+
+    file_etag(etag, sizeof(etag), st);
+    if (encoding == file_gzip)
+    {
+        /* A distinct validator per representation */
+        size_t length = strlen(etag);
+        snprintf(etag + length - 1, sizeof(etag) - length + 1, "-gz\"");
+        headers_length = snprintf(headers, sizeof(headers),
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Content-Encoding: gzip\r\n"
+                                  "Vary: Accept-Encoding\r\n"
+                                  "ETag: %s\r\n"
+                                  "Content-Length: %zu\r\n\r\n",
+                                  etag, size);
+    }
+    else
+    {
+        headers_length = snprintf(headers, sizeof(headers),
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Accept-Ranges: bytes\r\n"
+                                  "Vary: Accept-Encoding\r\n"
+                                  "ETag: %s\r\n"
+                                  "Content-Length: %zu\r\n\r\n",
+                                  etag, size);
+    }
+
+    size_t cost = sizeof(cache_entry_t) + path_length + 1 + headers_length + size;
+    if (cost > capacity)
+    {
+        errno = EFBIG;
+        return NULL;
+    }
+    cache_entry_t *entry = (cache_entry_t *)malloc(cost);
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+
+    char *text = entry->path;
+    memcpy(text, path, path_length + 1);
+    text += path_length + 1;
+    memcpy(text, headers, headers_length);
+    entry->file.headers = text;
+    entry->file.headers_length = headers_length;
+    entry->file.data = text + headers_length;
+    entry->file.size = size;
+    memcpy(entry->file.etag, etag, sizeof(etag));
+
+    entry->chain = NULL;
+    entry->lru_prev = entry->lru_next = NULL;
+    entry->hash = hash;
+    entry->encoding = encoding;
+    entry->status = entry_ready;
+    entry->sibling = 0;
+    entry->refs = 0;
+    entry->linked = 1;
+    entry->validated = now_ms();
+    entry->mtime = st->st_mtim;
+    entry->size = st->st_size;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->cost = cost;
+    return entry;
+}
+
+/* Reads a whole regular file no larger than max_entry into an entry keyed by path, a larger one gets an entry_oversize marker */
+static cache_entry_t *entry_load(const char *file, const char *path, uint32_t hash, file_encoding_t encoding,
+                                 size_t max_entry, size_t capacity)
+{
+    struct stat st;
+    cache_entry_t *entry;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        errno = EFBIG;
+        return NULL;
+    }
+    /* Remembered with its identity, so asking again costs a stat rather than an open */
+    if ((size_t)st.st_size > max_entry)
+    {
+        close(fd);
+        entry = entry_create(path, hash, encoding, &st, 0, capacity);
+        if (entry == NULL)
+        {
+            errno = EFBIG;
+            return NULL;
+        }
+        entry->status = entry_oversize;
+        return entry;
+    }
+
+    entry = entry_create(path, hash, encoding, &st, st.st_size, capacity);
+    if (entry == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = (char *)entry->file.data;
+    size_t loaded = 0;
+    while (loaded < entry->file.size)
+    {
+        ssize_t n = read(fd, data + loaded, entry->file.size - loaded);
+        if (n > 0)
+        {
+            loaded += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        /* Truncated while we read it, let the caller fall back */
+        close(fd);
+        free(entry);
+        errno = EIO;
+        return NULL;
+    }
+    close(fd);
+    return entry;
+}
+
+void file_etag(char *buffer, size_t size, const struct stat *st)
+{
+    snprintf(buffer, size, "\"%llx-%llx-%llx\"",
+             (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec);
+}
+
+file_cache_t *file_cache_create(size_t capacity, size_t max_entry)
+{
+    file_cache_t *cache = (file_cache_t *)calloc(1, sizeof(file_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->max_entry = max_entry;
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        if (mtx_init(&cache->shards[i].lock, mtx_plain) != thrd_success)
+        {
+            while (--i >= 0)
+            {
+                mtx_destroy(&cache->shards[i].lock);
+            }
+            free(cache);
+            return NULL;
+        }
+        cache->shards[i].capacity = capacity / FILE_CACHE_SHARDS;
+    }
+    return cache;
+}
+
+/* A miss: the file itself, path.gz, or a placeholder until file_cache_compress() runs */
+static cache_entry_t *entry_miss(file_cache_t *cache, const char *path, uint32_t hash, file_encoding_t encoding,
+                                 size_t capacity)
+{
+    if (encoding == file_identity)
+    {
+        return entry_load(path, path, hash, encoding, cache->max_entry, capacity);
+    }
+
+    char sibling[PATH_MAX];
+    if (snprintf(sibling, sizeof(sibling), "%s.gz", path) >= (int)sizeof(sibling))
+    {
+        return NULL;
+    }
+    cache_entry_t *entry = entry_load(sibling, path, hash, encoding, cache->max_entry, capacity);
+    if (entry != NULL)
+    {
+        entry->sibling = 1;
+        return entry;
+    }
+    if (errno != ENOENT)
+    {
+        return NULL;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return NULL;
+    }
+    entry = entry_create(path, hash, encoding, &st, 0, capacity);
+    if (entry != NULL)
+    {
+        /* Too large to compress in memory, the file goes out as is */
+        entry->status = (size_t)st.st_size > cache->max_entry ? entry_skip : entry_pending;
+    }
+    return entry;
+}
+
+const file_entry_t *file_cache_get(file_cache_t *cache, const char *path, file_encoding_t encoding, int *compress)
+{
+    uint32_t hash = path_hash(path, encoding);
+    cache_shard_t *shard = shard_of(cache, hash);
+    long long now = now_ms();
+
+    *compress = 0;
+
+    mtx_lock(&shard->lock);
+    cache_entry_t *entry = shard_find(shard, hash, encoding, path);
+    long long validated = 0;
+    if (entry != NULL)
+    {
+        entry->refs++;
+        validated = entry->validated;
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+    }
+    mtx_unlock(&shard->lock);
+
+    if (entry != NULL)
+    {
+        int fresh = now - validated < FILE_CACHE_REVALIDATE_MS;
+        if (!fresh)
+        {
+            /* Stale: one stat decides whether the entry still matches the disk */
+            struct stat st;
+            if (entry_stat(entry, &st) == 0 && same_file(entry, &st) && !sibling_appeared(entry))
+            {
+                mtx_lock(&shard->lock);
+                entry->validated = now;
+                mtx_unlock(&shard->lock);
+                fresh = 1;
+            }
+        }
+        if (fresh && entry->status == entry_ready)
+        {
+            return &entry->file;
+        }
+        entry_status_t status = entry->status;
+        file_cache_release(cache, &entry->file);
+        if (fresh)
+        {
+            errno = status == entry_oversize ? EFBIG : 0;
+            return NULL;
+        }
+    }
+
+    cache_entry_t *loaded = entry_miss(cache, path, hash, encoding, shard->capacity);
+    int error = loaded ? 0 : errno;
+
+    mtx_lock(&shard->lock);
+    if (loaded != NULL)
+    {
+        /* Somebody else already queued the compression */
+        cache_entry_t *old = shard_find(shard, hash, encoding, path);
+        if (loaded->status == entry_pending && old != NULL && old->status == entry_pending && same_version(old, loaded))
+        {
+            free(loaded);
+            loaded = NULL;
+        }
+        else
+        {
+            shard_insert(shard, loaded);
+            if (loaded->status == entry_ready)
+            {
+                loaded->refs++;
+            }
+            else
+            {
+                *compress = loaded->status == entry_pending;
+                error = loaded->status == entry_oversize ? EFBIG : 0;
+                loaded = NULL;
+            }
+        }
+    }
+    else
+    {
+        cache_entry_t *old = shard_find(shard, hash, encoding, path);
+        if (old != NULL)
+        {
+            shard_unlink(shard, old);
+        }
+    }
+    mtx_unlock(&shard->lock);
+
+    errno = error;
+    return loaded ? &loaded->file : NULL;
+}
+
+/* Drops a pending placeholder so a later request queues the work again */
+static void compress_failed(cache_shard_t *shard, uint32_t hash, const char *path)
+{
+    mtx_lock(&shard->lock);
+    cache_entry_t *old = shard_find(shard, hash, file_gzip, path);
+    if (old != NULL && old->status == entry_pending)
+    {
+        shard_unlink(shard, old);
+    }
+    mtx_unlock(&shard->lock);
+}
+
+int file_cache_compress(file_cache_t *cache, const char *path)
+{
+    uint32_t hash = path_hash(path, file_gzip);
+    cache_shard_t *shard = shard_of(cache, hash);
+    cache_entry_t *source = entry_load(path, path, hash, file_identity, cache->max_entry, (size_t)-1);
+    if (source == NULL || source->status == entry_oversize)
+    {
+        free(source);
+        compress_failed(shard, hash, path);
+        return -1;
+    }
+
+    /* Spent once per file version, so take the best ratio */
+    z_stream zs = {0};
+    uLong bound = 0;
+    cache_entry_t *entry = NULL;
+    struct stat st = {0};
+    st.st_size = source->size;
+    st.st_mtim = source->mtime;
+    st.st_dev = source->dev;
+    st.st_ino = source->ino;
+
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        free(source);
+        compress_failed(shard, hash, path);
+        return -1;
+    }
+    bound = deflateBound(&zs, source->file.size);
+    entry = entry_create(path, hash, file_gzip, &st, bound, shard->capacity);
+    if (entry != NULL)
+    {
+        zs.next_in = (Bytef *)source->file.data;
+        zs.avail_in = source->file.size;
+        zs.next_out = (Bytef *)entry->file.data;
+        zs.avail_out = bound;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+        {
+            free(entry);
+            entry = NULL;
+        }
+    }
+    deflateEnd(&zs);
+    free(source);
+
+    if (entry == NULL || st.st_size < 0 || (off_t)zs.total_out >= st.st_size)
+    {
+        /* Not worth it (or too big to keep): remember that until the file changes */
+        free(entry);
+        entry = entry_create(path, hash, file_gzip, &st, 0, shard->capacity);
+        if (entry == NULL)
+        {
+            compress_failed(shard, hash, path);
+            return -1;
+        }
+        entry->status = entry_skip;
+    }
+    else
+    {
+        /* Rebuild with the real length in the headers, the bound was only for deflate */
+        cache_entry_t *sized = entry_create(path, hash, file_gzip, &st, zs.total_out, shard->capacity);
+        if (sized == NULL)
+        {
+            free(entry);
+            compress_failed(shard, hash, path);
+            return -1;
+        }
+        memcpy((char *)sized->file.data, entry->file.data, zs.total_out);
+        free(entry);
+        entry = sized;
+    }
+
+    mtx_lock(&shard->lock);
+    /* Keep a path.gz that showed up in the meantime */
+    cache_entry_t *old = shard_find(shard, hash, file_gzip, path);
+    if (old != NULL && old->sibling)
+    {
+        free(entry);
+    }
+    else
+    {
+        shard_insert(shard, entry);
+    }
+    mtx_unlock(&shard->lock);
+    return 0;
+}
+
+void file_cache_abandon(file_cache_t *cache, const char *path)
+{
+    uint32_t hash = path_hash(path, file_gzip);
+    compress_failed(shard_of(cache, hash), hash, path);
+}
+
+void file_cache_release(file_cache_t *cache, const file_entry_t *file)
+{
+    cache_entry_t *entry = (cache_entry_t *)file;
+    cache_shard_t *shard = shard_of(cache, entry->hash);
+
+    mtx_lock(&shard->lock);
+    int dead = (--entry->refs == 0 && !entry->linked);
+    mtx_unlock(&shard->lock);
+
+    if (dead)
+    {
+        free(entry);
+    }
+}
+
+void file_cache_destroy(file_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++)
+    {
+        cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head)
+        {
+            shard_unlink(shard, shard->lru_head);
+        }
+        mtx_destroy(&shard->lock);
+    }
+    free(cache);
+}
@@ -0,0 +1,120 @@
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file file_cache.h
+     * @brief Sharded in-memory cache of small static files
+     *
+     * Paths hash to one of FILE_CACHE_SHARDS shards, each with its own lock,
+     * table and LRU list, so workers serving different files rarely meet.
+     * An entry holds a heap copy of the file together with its precomputed
+     * content headers (Content-Type, Accept-Ranges, ETag, Content-Length).
+     * Entries are revalidated against the file's mtime, size and inode at
+     * most once every FILE_CACHE_REVALIDATE_MS. Each shard evicts least recently used
+     * entries to stay within its share of the byte budget.
+     *
+     * A file can also be cached gzip encoded. The variant comes from a
+     * path.gz sibling when one exists, otherwise from file_cache_compress(),
+     * which runs off the request path once per file version. Files that do
+     * not shrink are remembered and served identity encoded. Files larger
+     * than max_entry are remembered too, so asking for one again costs a
+     * stat like a cached file.
+     */
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 512
+#define FILE_CACHE_REVALIDATE_MS 1000
+#define FILE_ETAG_SIZE 48
+
+    /**
+     *  @struct file_entry_t
+     *  @brief A cached file, valid until file_cache_release()
+     *
+     *  @var data           File contents.
+     *  @var size           Bytes in data.
+     *  @var headers        Content headers ending with the blank line.
+     *  @var headers_length Bytes in headers.
+     *  @var etag           Quoted strong validator, NUL terminated.
+     */
+    typedef struct
+    {
+        const char *data;
+        size_t size;
+        const char *headers;
+        size_t headers_length;
+        char etag[FILE_ETAG_SIZE];
+    } file_entry_t;
+
+    typedef enum
+    {
+        file_identity = 0,
+        file_gzip = 1
+    } file_encoding_t;
+
+    typedef struct file_cache_t file_cache_t;
+
+    /**
+     * @function file_cache_create
+     * @brief Creates a cache holding up to capacity bytes of files no
+     *        larger than max_entry bytes each.
+     */
+    file_cache_t *file_cache_create(size_t capacity, size_t max_entry);
+
+    /**
+     * @function file_cache_get
+     * @brief Returns a referenced entry for path in the given encoding,
+     *        loading it on a miss. *compress is set for exactly one caller
+     *        when a gzip variant has to be made with file_cache_compress().
+     * @return the entry, or NULL when path is missing, not a regular file,
+     * too large to cache, or has no gzip variant yet. errno is EFBIG when
+     * only the size was the problem.
+     */
+    const file_entry_t *file_cache_get(file_cache_t *cache, const char *path, file_encoding_t encoding, int *compress);
+
+    /**
+     * @function file_cache_compress
+     * @brief Compresses path and caches the result as its gzip variant.
+     *        Slow, meant for a background worker.
+     * @return 0 on success, -1 if the file could not be read or compressed
+     */
+    int file_cache_compress(file_cache_t *cache, const char *path);
+
+    /**
+     * @function file_cache_abandon
+     * @brief Gives up the compression promised by file_cache_get() without
+     *        running file_cache_compress(), so a later request asks again.
+     */
+    void file_cache_abandon(file_cache_t *cache, const char *path);
+
+    /**
+     * @function file_cache_release
+     * @brief Drops the reference taken by file_cache_get().
+     */
+    void file_cache_release(file_cache_t *cache, const file_entry_t *entry);
+
+    /**
+     * @function file_etag
+     * @brief Writes the strong ETag for a file version, built from its
+     *        inode, size and mtime, so cached and streamed responses agree.
+     */
+    void file_etag(char *buffer, size_t size, const struct stat *st);
+
+    /**
+     * @function file_cache_destroy
+     * @brief Frees the cache. No entry may still be referenced.
+     */
+    void file_cache_destroy(file_cache_t *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FILE_CACHE_H_ */
@@ -0,0 +1,119 @@
+/* Generated by tools/gen_header_hash.py, do not edit */
+
+#include "header_hash.h"
+
+const char *const header_names[HEADER_KNOWN_COUNT] = {
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Encoding",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "Expect",
+    "Forwarded",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Origin",
+    "Pragma",
+    "Range",
+    "Referer",
+    "TE",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Via",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Real-IP",
+    "X-Request-ID",
+};
+
+const uint8_t header_name_lengths[HEADER_KNOWN_COUNT] = {
+    6,
+    14,
+    15,
+    15,
+    13,
+    13,
+    10,
+    16,
+    14,
+    12,
+    6,
+    4,
+    6,
+    9,
+    4,
+    8,
+    17,
+    13,
+    8,
+    19,
+    10,
+    6,
+    6,
+    5,
+    7,
+    2,
+    17,
+    7,
+    10,
+    3,
+    15,
+    17,
+    9,
+    12,
+};
+
+const uint16_t header_hash_displacements[HEADER_HASH_BUCKETS] = {
+    0, 0, 153, 9, 6, 324, 91, 114,
+};
+
+/* Slot to header_id_t */
+const int8_t header_hash_slots[HEADER_KNOWN_COUNT] = {
+    header_if_range,
+    header_x_forwarded_proto,
+    header_range,
+    header_accept_charset,
+    header_content_encoding,
+    header_accept_language,
+    header_accept,
+    header_cache_control,
+    header_user_agent,
+    header_expect,
+    header_x_forwarded_for,
+    header_accept_encoding,
+    header_content_length,
+    header_transfer_encoding,
+    header_if_match,
+    header_forwarded,
+    header_x_real_ip,
+    header_date,
+    header_host,
+    header_if_unmodified_since,
+    header_te,
+    header_referer,
+    header_if_none_match,
+    header_content_type,
+    header_via,
+    header_pragma,
+    header_authorization,
+    header_keep_alive,
+    header_origin,
+    header_if_modified_since,
+    header_connection,
+    header_x_request_id,
+    header_cookie,
+    header_upgrade,
+};
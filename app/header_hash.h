@@ -0,0 +1,54 @@
+/* Generated by tools/gen_header_hash.py, do not edit */
+#ifndef _HEADER_HASH_H_
+#define _HEADER_HASH_H_
+
+#include <stdint.h>
+
+#define HEADER_KNOWN_COUNT 34
+#define HEADER_HASH_BUCKETS 8
+
+typedef enum
+{
+    header_unknown = -1,
+    header_accept = 0,
+    header_accept_charset = 1,
+    header_accept_encoding = 2,
+    header_accept_language = 3,
+    header_authorization = 4,
+    header_cache_control = 5,
+    header_connection = 6,
+    header_content_encoding = 7,
+    header_content_length = 8,
+    header_content_type = 9,
+    header_cookie = 10,
+    header_date = 11,
+    header_expect = 12,
+    header_forwarded = 13,
+    header_host = 14,
+    header_if_match = 15,
+    header_if_modified_since = 16,
+    header_if_none_match = 17,
+    header_if_range = 18,
+    header_if_unmodified_since = 19,
+    header_keep_alive = 20,
+    header_origin = 21,
+    header_pragma = 22,
+    header_range = 23,
+    header_referer = 24,
+    header_te = 25,
+    header_transfer_encoding = 26,
+    header_upgrade = 27,
+    header_user_agent = 28,
+    header_via = 29,
+    header_x_forwarded_for = 30,
+    header_x_forwarded_proto = 31,
+    header_x_real_ip = 32,
+    header_x_request_id = 33,
+} header_id_t;
+
+extern const char *const header_names[HEADER_KNOWN_COUNT];
+extern const uint8_t header_name_lengths[HEADER_KNOWN_COUNT];
+extern const uint16_t header_hash_displacements[HEADER_HASH_BUCKETS];
+extern const int8_t header_hash_slots[HEADER_KNOWN_COUNT];
+
+#endif /* _HEADER_HASH_H_ */
@@ -0,0 +1,74 @@
+/**
+ * @file headers.c
+ * @brief Request header table
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "headers.h"
+
+/* Must match fnv1a() and slot() in tools/gen_header_hash.py */
+header_id_t header_lookup(const char *name, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i] | 0x20;
+        hash *= 0x100000001b3ull;
+    }
+
+    uint32_t displacement = header_hash_displacements[hash % HEADER_HASH_BUCKETS];
+    header_id_t id = (header_id_t)header_hash_slots[((uint32_t)(hash >> 32) ^ (displacement * 0x9e3779b1u)) % HEADER_KNOWN_COUNT];
+
+    if (header_name_lengths[id] != length || strncasecmp(name, header_names[id], length) != 0)
+    {
+        return header_unknown;
+    }
+    return id;
+}
+
+void header_table_build(header_table_t *table, const char *buffer, const http_parser_t *parser)
+{
+    memset(table->known, 0, sizeof(table->known));
+    table->extra_count = 0;
+
+    for (int i = 0; i < parser->header_count; i++)
+    {
+        http_string_t name = http_string(buffer, parser->headers[i].name);
+        http_string_t value = http_string(buffer, parser->headers[i].value);
+        header_id_t id = header_lookup(name.data, name.length);
+
+        if (id == header_unknown)
+        {
+            table->extra[table->extra_count].name = name;
+            table->extra[table->extra_count].value = value;
+            table->extra_count++;
+        }
+        else if (!table->known[id].data)
+        {
+            table->known[id] = value;
+        }
+    }
+}
+
+http_string_t header_find(const header_table_t *table, const char *name)
+{
+    size_t length = strlen(name);
+    header_id_t id = header_lookup(name, length);
+    http_string_t missing = {NULL, 0};
+
+    if (id != header_unknown)
+    {
+        return table->known[id];
+    }
+    for (int i = 0; i < table->extra_count; i++)
+    {
+        if (table->extra[i].name.length == length && strncasecmp(table->extra[i].name.data, name, length) == 0)
+        {
+            return table->extra[i].value;
+        }
+    }
+    return missing;
+}
@@ -0,0 +1,79 @@
+#ifndef _HEADERS_H_
+#define _HEADERS_H_
+
+#include <stddef.h>
+
+#include "parser.h"
+#include "header_hash.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file headers.h
+     * @brief Request header table
+     *
+     * Well-known headers (see tools/gen_header_hash.py) are resolved
+     * through a minimal perfect hash into fixed slots indexed by
+     * header_id_t. Every other header goes to the extra array. Values are
+     * views into the receive buffer, nothing is copied.
+     */
+
+    typedef struct
+    {
+        http_string_t name;
+        http_string_t value;
+    } header_field_t;
+
+    /**
+     *  @struct header_table_t
+     *  @brief Headers of one request
+     *
+     *  @var known       Well-known headers, data is NULL when absent.
+     *  @var extra       Headers without a slot, in arrival order.
+     *  @var extra_count Entries used in extra.
+     */
+    typedef struct
+    {
+        http_string_t known[HEADER_KNOWN_COUNT];
+        header_field_t extra[HTTP_MAX_HEADERS];
+        int extra_count;
+    } header_table_t;
+
+    /**
+     * @function header_lookup
+     * @brief Maps a header name, in any case, to its well-known id.
+     * @return the id or header_unknown
+     */
+    header_id_t header_lookup(const char *name, size_t length);
+
+    /**
+     * @function header_table_build
+     * @brief Sorts the parsed headers of a request into a table.
+     *
+     * Only the first occurrence of a well-known header is kept.
+     */
+    void header_table_build(header_table_t *table, const char *buffer, const http_parser_t *parser);
+
+    /**
+     * @function header_get
+     * @brief Value of a well-known header, data is NULL when absent.
+     */
+    static inline http_string_t header_get(const header_table_t *table, header_id_t id)
+    {
+        return table->known[id];
+    }
+
+    /**
+     * @function header_find
+     * @brief Value of any header by name, data is NULL when absent.
+     */
+    http_string_t header_find(const header_table_t *table, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HEADERS_H_ */
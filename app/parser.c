@@ -0,0 +1,324 @@
+/**
+ * @file parser.c
+ * @brief Incremental, zero-copy HTTP/1.x request parser
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#include "parser.h"
+#include "scan.h"
+
+typedef enum
+{
+    s_start = 0,
+    s_method,
+    s_target,
+    s_version,
+    s_request_line_lf,
+    s_header_start,
+    s_header_name,
+    s_header_value_start,
+    s_header_value,
+    s_header_lf,
+    s_headers_lf,
+    s_body,
+    s_done
+} http_state_t;
+
+static http_slice_t slice(size_t start, size_t end)
+{
+    http_slice_t s = {(uint32_t)start, (uint32_t)(end - start)};
+    return s;
+}
+
+void http_parser_init(http_parser_t *parser)
+{
+    memset(parser, 0, sizeof(http_parser_t));
+    parser->state = s_start;
+}
+
+int http_parser_done(const http_parser_t *parser)
+{
+    return parser->state == s_done;
+}
+
+static int parse_version(http_parser_t *parser, const char *buffer)
+{
+    const char *v = buffer + parser->version.offset;
+    if (parser->version.length != 8 || memcmp(v, "HTTP/1.", 7) != 0 || v[7] < '0' || v[7] > '9')
+    {
+        return -1;
+    }
+    parser->minor_version = v[7] - '0';
+    return 0;
+}
+
+static int parse_content_length(http_parser_t *parser, const char *value, size_t length)
+{
+    size_t content_length = 0;
+
+    if (length == 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (value[i] < '0' || value[i] > '9' || content_length > (SIZE_MAX - 9) / 10)
+        {
+            return -1;
+        }
+        content_length = content_length * 10 + (value[i] - '0');
+    }
+
+    /* Repeated Content-Length must agree (RFC 9112 section 6.3) */
+    if (parser->has_content_length && parser->content_length != content_length)
+    {
+        return -1;
+    }
+    parser->has_content_length = 1;
+    parser->content_length = content_length;
+    return 0;
+}
+
+static int header_finish(http_parser_t *parser, const char *buffer)
+{
+    http_header_t *header = &parser->headers[parser->header_count++];
+    header->value = slice(parser->mark, parser->value_end);
+
+    const char *name = buffer + header->name.offset;
+    const char *value = buffer + header->value.offset;
+
+    if (header->name.length == 14 && strncasecmp(name, "content-length", 14) == 0)
+    {
+        return parse_content_length(parser, value, header->value.length);
+    }
+    if (header->name.length == 17 && strncasecmp(name, "transfer-encoding", 17) == 0)
+    {
+        /* Only chunked is decoded, anything else could not be framed */
+        if (parser->chunked || header->value.length != 7 || strncasecmp(value, "chunked", 7) != 0)
+        {
+            return -1;
+        }
+        parser->chunked = 1;
+        parser->streamed = 1;
+    }
+    else if (header->name.length == 6 && strncasecmp(name, "expect", 6) == 0)
+    {
+        parser->expect_continue = header->value.length == 12 && strncasecmp(value, "100-continue", 12) == 0;
+    }
+    return 0;
+}
+
+/* Jump over a run of bytes the vector kernels accept, stop at the first one they do not */
+#define SKIP(scanner)                              \
+    do                                             \
+    {                                              \
+        p += scanner(buffer + p, length - p);      \
+        if (p == length)                           \
+        {                                          \
+            goto out;                              \
+        }                                          \
+        c = buffer[p];                             \
+    } while (0)
+
+http_parse_status_t http_parse(http_parser_t *parser, const char *buffer, size_t length)
+{
+    size_t p = parser->position;
+
+    for (; p < length && parser->state < s_body; p++)
+    {
+        char c = buffer[p];
+
+        switch (parser->state)
+        {
+        case s_start:
+            /* Tolerate empty lines before the request line */
+            if (c == '\r' || c == '\n')
+            {
+                break;
+            }
+            parser->mark = p;
+            parser->state = s_method;
+            /* fall through */
+        case s_method:
+            SKIP(scan_token);
+            if (c != ' ' || p == parser->mark)
+            {
+                goto error;
+            }
+            parser->method = slice(parser->mark, p);
+            parser->mark = p + 1;
+            parser->state = s_target;
+            break;
+
+        case s_target:
+            SKIP(scan_target);
+            if (c != ' ' || p == parser->mark)
+            {
+                goto error;
+            }
+            parser->target = slice(parser->mark, p);
+            parser->mark = p + 1;
+            parser->state = s_version;
+            break;
+
+        case s_version:
+            SKIP(scan_value);
+            if (c != '\r' && c != '\n')
+            {
+                goto error;
+            }
+            parser->version = slice(parser->mark, p);
+            if (parse_version(parser, buffer) != 0)
+            {
+                goto error;
+            }
+            parser->state = (c == '\r') ? s_request_line_lf : s_header_start;
+            break;
+
+        case s_request_line_lf:
+        case s_header_lf:
+            if (c != '\n')
+            {
+                goto error;
+            }
+            parser->state = s_header_start;
+            break;
+
+        case s_header_start:
+            if (c == '\r')
+            {
+                parser->state = s_headers_lf;
+                break;
+            }
+            if (c == '\n')
+            {
+                goto headers_done;
+            }
+            parser->mark = p;
+            parser->state = s_header_name;
+            /* fall through */
+        case s_header_name:
+            SKIP(scan_token);
+            if (c != ':' || p == parser->mark || parser->header_count == HTTP_MAX_HEADERS)
+            {
+                goto error;
+            }
+            parser->headers[parser->header_count].name = slice(parser->mark, p);
+            parser->state = s_header_value_start;
+            break;
+
+        case s_header_value_start:
+            if (c == ' ' || c == '\t')
+            {
+                break;
+            }
+            parser->mark = parser->value_end = p;
+            parser->state = s_header_value;
+            /* fall through */
+        case s_header_value:
+        {
+            size_t run = scan_value(buffer + p, length - p);
+            size_t end = p + run;
+
+            /* Trailing whitespace is not part of the value */
+            while (end > p && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t'))
+            {
+                end--;
+            }
+            if (end > p)
+            {
+                parser->value_end = end;
+            }
+            p += run;
+            if (p == length)
+            {
+                goto out;
+            }
+            c = buffer[p];
+
+            if (c != '\r' && c != '\n')
+            {
+                goto error;
+            }
+            if (header_finish(parser, buffer) != 0)
+            {
+                goto error;
+            }
+            parser->state = (c == '\r') ? s_header_lf : s_header_start;
+            break;
+        }
+
+        case s_headers_lf:
+            if (c != '\n')
+            {
+                goto error;
+            }
+        headers_done:
+            /* Both framings at once is a smuggling vector (RFC 9112 section 6.3) */
+            if (parser->chunked && parser->has_content_length)
+            {
+                goto error;
+            }
+            /* The framed length has to be representable, or it wraps into the headers */
+            if (parser->content_length > SIZE_MAX - (p + 1))
+            {
+                goto error;
+            }
+            parser->header_length = p + 1;
+            parser->length = parser->header_length + parser->content_length;
+            parser->state = s_body;
+            break;
+        }
+    }
+
+out:
+    parser->position = p;
+
+    if (parser->state == s_body && length >= parser->length)
+    {
+        parser->state = s_done;
+    }
+    return parser->state == s_done ? http_parse_complete : http_parse_again;
+
+error:
+    parser->position = p;
+    return http_parse_error;
+}
+
+void http_parser_detach_body(http_parser_t *parser)
+{
+    parser->length = parser->header_length;
+    parser->streamed = 1;
+    parser->state = s_done;
+}
+
+int http_token_contains(const char *value, size_t length, const char *token)
+{
+    size_t token_length = strlen(token);
+    size_t i = 0;
+
+    while (i < length)
+    {
+        while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+        {
+            i++;
+        }
+        size_t start = i;
+        while (i < length && value[i] != ',')
+        {
+            i++;
+        }
+        size_t end = i;
+        while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+        {
+            end--;
+        }
+        if (end - start == token_length && strncasecmp(value + start, token, token_length) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
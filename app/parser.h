@@ -0,0 +1,140 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file parser.h
+     * @brief Incremental, zero-copy HTTP/1.x request parser
+     *
+     * The parser never copies or modifies the request. Every token is
+     * recorded as an (offset, length) slice relative to the start of the
+     * request, so the caller's buffer may grow between calls as long as
+     * the bytes already handed in stay where they are.
+     */
+
+#define HTTP_MAX_HEADERS 32
+
+    typedef enum
+    {
+        http_parse_error = -1,
+        http_parse_again = 0,
+        http_parse_complete = 1
+    } http_parse_status_t;
+
+    typedef struct
+    {
+        uint32_t offset;
+        uint32_t length;
+    } http_slice_t;
+
+    /* A slice resolved against its buffer */
+    typedef struct
+    {
+        const char *data;
+        size_t length;
+    } http_string_t;
+
+    typedef struct
+    {
+        http_slice_t name;
+        http_slice_t value;
+    } http_header_t;
+
+    /**
+     *  @struct http_parser_t
+     *  @brief Parser state and results
+     *
+     *  @var state          Current state machine state.
+     *  @var position       Next byte to look at.
+     *  @var mark           Start of the token being scanned.
+     *  @var value_end      End of the header value so far, trailing spaces excluded.
+     *  @var header_length  Bytes of request line and headers, blank line included.
+     *  @var content_length Declared body size.
+     *  @var length         Total request size once the headers are complete.
+     *  @var minor_version  The x in HTTP/1.x.
+     *  @var chunked        Transfer-Encoding: chunked, the body follows length.
+     *  @var expect_continue Expect: 100-continue.
+     *  @var streamed       The body is not part of length and has to be read
+     *                      separately (chunked or detached).
+     */
+    typedef struct
+    {
+        int state;
+        size_t position;
+        size_t mark;
+        size_t value_end;
+        http_slice_t method;
+        http_slice_t target;
+        http_slice_t version;
+        http_header_t headers[HTTP_MAX_HEADERS];
+        int header_count;
+        int minor_version;
+        int has_content_length;
+        size_t content_length;
+        size_t header_length;
+        size_t length;
+        int chunked;
+        int expect_continue;
+        int streamed;
+    } http_parser_t;
+
+    /**
+     * @function http_parser_init
+     * @brief Resets a parser for a new request.
+     */
+    void http_parser_init(http_parser_t *parser);
+
+    /**
+     * @function http_parse
+     * @brief Continues parsing a request.
+     * @param buffer Start of the request, unchanged since the previous call.
+     * @param length Bytes available in buffer.
+     * @return http_parse_complete once headers and body are buffered,
+     * http_parse_again if more data is needed, http_parse_error for a
+     * malformed request.
+     */
+    http_parse_status_t http_parse(http_parser_t *parser, const char *buffer, size_t length);
+
+    /**
+     * @function http_parser_done
+     * @brief Whether the last call returned http_parse_complete.
+     */
+    int http_parser_done(const http_parser_t *parser);
+
+    /**
+     * @function http_parser_detach_body
+     * @brief Completes a request whose headers are parsed without waiting
+     *        for its Content-Length body, which the caller then reads from
+     *        the socket itself. length becomes header_length.
+     */
+    void http_parser_detach_body(http_parser_t *parser);
+
+    /**
+     * @function http_string
+     * @brief Resolves a slice against the buffer it was parsed from.
+     */
+    static inline http_string_t http_string(const char *buffer, http_slice_t slice)
+    {
+        http_string_t string = {buffer + slice.offset, slice.length};
+        return string;
+    }
+
+    /**
+     * @function http_token_contains
+     * @brief Case-insensitive search of a comma-separated header value,
+     *        e.g. "keep-alive" in "Keep-Alive, Upgrade".
+     */
+    int http_token_contains(const char *value, size_t length, const char *token);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PARSER_H_ */
@@ -0,0 +1,146 @@
+/**
+ * @file range.c
+ * @brief Range request header parsing
+ */
+
+#include <stdlib.h>
+#include <strings.h>
+
+#include "range.h"
+
+static int parse_offset(const char **p, const char *end, off_t *value)
+{
+    const char *start = *p;
+    off_t n = 0;
+
+    while (*p < end && **p >= '0' && **p <= '9')
+    {
+        if (n > ((off_t)1 << 62) / 10)
+        {
+            return -1;
+        }
+        n = n * 10 + (**p - '0');
+        (*p)++;
+    }
+    *value = n;
+    return *p == start ? -1 : 0;
+}
+
+static void skip_space(const char **p, const char *end)
+{
+    while (*p < end && (**p == ' ' || **p == '\t'))
+    {
+        (*p)++;
+    }
+}
+
+static int range_compare(const void *a, const void *b)
+{
+    off_t x = ((const range_t *)a)->first, y = ((const range_t *)b)->first;
+    return (x > y) - (x < y);
+}
+
+range_status_t range_parse(http_string_t value, off_t size, range_t *ranges, int *count)
+{
+    const char *p = value.data, *end = value.data + value.length;
+    int specs = 0;
+
+    *count = 0;
+    if (value.length < 6 || strncasecmp(p, "bytes=", 6) != 0)
+    {
+        return range_none;
+    }
+    p += 6;
+
+    for (;;)
+    {
+        off_t first, last;
+
+        skip_space(&p, end);
+        if (p < end && *p == '-')
+        {
+            /* Suffix: the last n bytes */
+            p++;
+            off_t suffix;
+            if (parse_offset(&p, end, &suffix) != 0)
+            {
+                return range_none;
+            }
+            first = suffix < size ? size - suffix : 0;
+            last = size - 1;
+            if (suffix == 0)
+            {
+                first = size;
+            }
+        }
+        else
+        {
+            if (parse_offset(&p, end, &first) != 0 || p == end || *p++ != '-')
+            {
+                return range_none;
+            }
+            if (p < end && *p >= '0' && *p <= '9')
+            {
+                if (parse_offset(&p, end, &last) != 0 || last < first)
+                {
+                    return range_none;
+                }
+                if (last >= size)
+                {
+                    last = size - 1;
+                }
+            }
+            else
+            {
+                last = size - 1;
+            }
+        }
+
+        if (++specs > RANGE_MAX)
+        {
+            return range_none;
+        }
+        /* Unsatisfiable members are dropped, the rest still count */
+        if (first < size)
+        {
+            ranges[*count].first = first;
+            ranges[*count].last = last;
+            (*count)++;
+        }
+
+        skip_space(&p, end);
+        if (p == end)
+        {
+            break;
+        }
+        if (*p++ != ',')
+        {
+            *count = 0;
+            return range_none;
+        }
+    }
+
+    if (*count == 0)
+    {
+        return range_unsatisfiable;
+    }
+
+    qsort(ranges, *count, sizeof(range_t), range_compare);
+    int merged = 0;
+    for (int i = 1; i < *count; i++)
+    {
+        if (ranges[i].first <= ranges[merged].last + 1)
+        {
+            if (ranges[i].last > ranges[merged].last)
+            {
+                ranges[merged].last = ranges[i].last;
+            }
+        }
+        else
+        {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    *count = merged + 1;
+    return range_satisfiable;
+}
@@ -0,0 +1,48 @@
+#ifndef _RANGE_H_
+#define _RANGE_H_
+
+#include <sys/types.h>
+
+#include "parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file range.h
+     * @brief Range request header parsing (RFC 9110 section 14)
+     */
+
+#define RANGE_MAX 16 // more ranges than this and the whole file is sent
+
+    typedef enum
+    {
+        range_none = 0,          /* absent or malformed: send the whole file */
+        range_satisfiable = 1,   /* ranges holds count sorted, disjoint ranges */
+        range_unsatisfiable = 2  /* 416 */
+    } range_status_t;
+
+    /**
+     *  @struct range_t
+     *  @brief Inclusive byte range
+     */
+    typedef struct
+    {
+        off_t first;
+        off_t last;
+    } range_t;
+
+    /**
+     * @function range_parse
+     * @brief Resolves a "bytes=" Range value against a representation of
+     *        size bytes. Overlapping and adjacent ranges are merged.
+     */
+    range_status_t range_parse(http_string_t value, off_t size, range_t *ranges, int *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RANGE_H_ */
@@ -0,0 +1,586 @@
+/**
+ * @file reactor.c
+ * @brief Edge-triggered epoll event loop
+ */
+
+#define _GNU_SOURCE // accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "colors.h"
+
+/**
+ *  @struct reactor_t
+ *  @brief The reactor struct
+ *
+ *  @var epoll_fd  Event queue for the listener, the wake fd and clients.
+ *  @var server_fd Nonblocking listening socket.
+ *  @var wake_fd   eventfd written by workers on completion.
+ *  @var pool      Workers running handler, NULL to run it on this thread.
+ *  @var lock      Protects completed.
+ *  @var completed Connections handed back by workers.
+ *  @var ready     Connections completed inline, only touched by this thread.
+ *  @var closed    Connections closed during the current batch of events.
+ *  @var deferred  Streams that yielded with the socket still writable.
+ *  @var idle_head Reactor-owned connections, least recently active first.
+ *  @var idle_timeout Milliseconds before an idle connection is closed.
+ *  @var stopping  Set by reactor_stop(), read at the top of each loop.
+ */
+struct reactor_t
+{
+    int epoll_fd;
+    int server_fd;
+    int wake_fd;
+    threadpool_t *pool;
+    reactor_frame_t frame;
+    void (*handler)(void *);
+    mtx_t lock;
+    struct Connection *completed;
+    struct Connection *ready;
+    struct Connection *closed;
+    struct Connection *deferred;
+    struct Connection *idle_head;
+    struct Connection *idle_tail;
+    int idle_timeout;
+    int stopping;
+};
+
+static void reactor_read(reactor_t *reactor, struct Connection *connection);
+static void reactor_receive(reactor_t *reactor, struct Connection *connection);
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void idle_remove(reactor_t *reactor, struct Connection *connection)
+{
+    if (connection->idle_prev)
+        connection->idle_prev->idle_next = connection->idle_next;
+    else if (reactor->idle_head == connection)
+        reactor->idle_head = connection->idle_next;
+    else
+        return; /* not on the list */
+
+    if (connection->idle_next)
+        connection->idle_next->idle_prev = connection->idle_prev;
+    else
+        reactor->idle_tail = connection->idle_prev;
+
+    connection->idle_prev = connection->idle_next = NULL;
+}
+
+/* Every entry shares one timeout, so appending keeps the list sorted */
+static void idle_touch(reactor_t *reactor, struct Connection *connection)
+{
+    idle_remove(reactor, connection);
+    connection->last_active = now_ms();
+    connection->idle_prev = reactor->idle_tail;
+    if (reactor->idle_tail)
+        reactor->idle_tail->idle_next = connection;
+    else
+        reactor->idle_head = connection;
+    reactor->idle_tail = connection;
+}
+
+reactor_t *reactor_create(int server_fd, threadpool_t *pool,
+                          reactor_frame_t frame, void (*handler)(void *),
+                          int idle_timeout)
+{
+    reactor_t *reactor;
+    struct epoll_event event = {0};
+
+    if (frame == NULL || handler == NULL)
+    {
+        return NULL;
+    }
+
+    if ((reactor = (reactor_t *)malloc(sizeof(reactor_t))) == NULL)
+    {
+        return NULL;
+    }
+
+    reactor->server_fd = server_fd;
+    reactor->pool = pool;
+    reactor->frame = frame;
+    reactor->handler = handler;
+    reactor->completed = reactor->ready = reactor->closed = reactor->deferred = NULL;
+    reactor->idle_head = reactor->idle_tail = NULL;
+    reactor->idle_timeout = idle_timeout;
+    reactor->stopping = 0;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (reactor->epoll_fd == -1 || reactor->wake_fd == -1 ||
+        mtx_init(&reactor->lock, mtx_plain) != thrd_success ||
+        set_nonblocking(server_fd) == -1)
+    {
+        goto err;
+    }
+
+    /* The listener and wake fd are told apart from clients by address */
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &reactor->server_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_fd, &event) == -1)
+    {
+        goto err;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &reactor->wake_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) == -1)
+    {
+        goto err;
+    }
+
+    return reactor;
+
+err:
+    printf(RED "Reactor creation failed: %s...\n" RESET, strerror(errno));
+    reactor_destroy(reactor);
+    return NULL;
+}
+
+void reactor_stop(reactor_t *reactor)
+{
+    uint64_t one = 1;
+    __atomic_store_n(&reactor->stopping, 1, __ATOMIC_RELEASE);
+    /* The wake fd gets the loop out of epoll_wait to see the flag */
+    if (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        printf(RED "Reactor wake failed: %s...\n" RESET, strerror(errno));
+    }
+}
+
+void reactor_destroy(reactor_t *reactor)
+{
+    if (reactor == NULL)
+    {
+        return;
+    }
+    if (reactor->epoll_fd != -1)
+    {
+        close(reactor->epoll_fd);
+    }
+    if (reactor->wake_fd != -1)
+    {
+        close(reactor->wake_fd);
+    }
+    free(reactor);
+}
+
+/* Frees happen after the event batch, a later event may still name the connection */
+static void reactor_close(reactor_t *reactor, struct Connection *connection)
+{
+    if (connection->state == connection_closed)
+    {
+        return;
+    }
+    connection->state = connection_closed;
+    idle_remove(reactor, connection);
+    close(connection->client_fd);
+    connection->next = reactor->closed;
+    reactor->closed = connection;
+}
+
+static void reactor_accept(reactor_t *reactor)
+{
+    for (;;)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_fd = accept4(reactor->server_fd, (struct sockaddr *)&client_addr,
+                                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                printf(RED "Client connection failed: %s \n" RESET, strerror(errno));
+            }
+            return;
+        }
+
+        struct Connection *connection = connection_create(client_fd, &client_addr);
+        if (connection == NULL)
+        {
+            printf(RED "Client refused: %s \n" RESET, strerror(errno));
+            close(client_fd);
+            continue;
+        }
+        connection->reactor = reactor;
+
+        /* Registered once for both directions, ownership is tracked in state */
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
+        {
+            printf(RED "Client registration failed: %s \n" RESET, strerror(errno));
+            close(client_fd);
+            connection_free(connection);
+            continue;
+        }
+        idle_touch(reactor, connection);
+        printf(CYAN "Client connected: %s:%d <----------\n" RESET, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    }
+}
+
+static void reactor_dispatch(reactor_t *reactor, struct Connection *connection)
+{
+    connection->state = connection_processing;
+    idle_remove(reactor, connection);
+    if (reactor->pool == NULL)
+    {
+        /* Answered on the spot, reactor_complete() queues it on ready */
+        reactor->handler((void *)connection);
+        return;
+    }
+    /* The pool may refuse it under load, its shed routine then answers */
+    if (threadpool_add(reactor->pool, reactor->handler, (void *)connection, threadpool_admission) != 0)
+    {
+        printf(RED "Failed to queue client: %s\n" RESET, strerror(errno));
+        reactor_close(reactor, connection);
+    }
+}
+
+static void reactor_write(reactor_t *reactor, struct Connection *connection)
+{
+    int status = connection_flush(connection);
+    if (status < 0)
+    {
+        reactor_close(reactor, connection);
+        return;
+    }
+    idle_touch(reactor, connection);
+    if (status == 0 && connection->writable)
+    {
+        /* No edge will come for a socket that is still writable, take it up after this batch */
+        idle_remove(reactor, connection);
+        connection->state = connection_deferred;
+        connection->next = reactor->deferred;
+        reactor->deferred = connection;
+        return;
+    }
+    if (status == 0)
+    {
+        connection->state = connection_writing;
+        return;
+    }
+
+    /* The worker accepted the body, stream it before answering */
+    if (connection->upload.state != upload_idle)
+    {
+        connection->length -= connection->request_length;
+        memmove(connection->buffer, connection->buffer + connection->request_length, connection->length);
+        connection->request_length = 0;
+        connection->state = connection_receiving;
+        reactor_receive(reactor, connection);
+        return;
+    }
+
+    /* Response delivered */
+    if (!connection->keep_alive || connection->peer_closed)
+    {
+        reactor_close(reactor, connection);
+        return;
+    }
+
+    /* Keep whatever the client already sent after this request */
+    connection->length -= connection->request_length;
+    memmove(connection->buffer, connection->buffer + connection->request_length, connection->length);
+    connection->request_length = 0;
+    connection->keep_alive = 0;
+    connection->state = connection_reading;
+    reactor_read(reactor, connection);
+}
+
+static void reactor_read(reactor_t *reactor, struct Connection *connection)
+{
+    size_t received = connection->length;
+
+    while (connection->readable && !connection->peer_closed &&
+           connection->length < CONNECTION_BUFFER_SIZE)
+    {
+        ssize_t n = recv(connection->client_fd,
+                         connection->buffer + connection->length,
+                         CONNECTION_BUFFER_SIZE - connection->length, 0);
+        if (n > 0)
+        {
+            connection->length += n;
+            continue;
+        }
+        if (n == 0)
+        {
+            connection->peer_closed = 1;
+            break;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            connection->readable = 0;
+            break;
+        }
+        reactor_close(reactor, connection);
+        return;
+    }
+
+    if (connection->length > received)
+    {
+        idle_touch(reactor, connection);
+    }
+
+    if (connection->length == 0)
+    {
+        if (connection->peer_closed)
+        {
+            reactor_close(reactor, connection);
+        }
+        return;
+    }
+
+    switch (reactor->frame(connection))
+    {
+    case 1:
+        reactor_dispatch(reactor, connection);
+        break;
+    case 0:
+        if (connection->peer_closed)
+        {
+            reactor_close(reactor, connection);
+        }
+        break;
+    default:
+        /* Best effort delivery of whatever error the framer queued */
+        connection_flush(connection);
+        reactor_close(reactor, connection);
+        break;
+    }
+}
+
+static void reactor_receive(reactor_t *reactor, struct Connection *connection)
+{
+    int status = upload_receive(&connection->upload, connection->client_fd, connection->buffer, &connection->length);
+    if (status < 0)
+    {
+        reactor_close(reactor, connection);
+        return;
+    }
+    idle_touch(reactor, connection);
+    if (status == 0)
+    {
+        connection->readable = 0;
+        return;
+    }
+
+    /* Body stored, the worker answers the request */
+    reactor_dispatch(reactor, connection);
+}
+
+static void reactor_expire(reactor_t *reactor, long long now)
+{
+    while (reactor->idle_head != NULL &&
+           now - reactor->idle_head->last_active >= reactor->idle_timeout)
+    {
+        reactor_close(reactor, reactor->idle_head);
+    }
+}
+
+static int reactor_next_timeout(reactor_t *reactor, long long now)
+{
+    if (reactor->idle_timeout <= 0 || reactor->idle_head == NULL)
+    {
+        return -1;
+    }
+    long long wait = reactor->idle_head->last_active + reactor->idle_timeout - now;
+    return wait > 0 ? (int)wait : 0;
+}
+
+static void reactor_resume(reactor_t *reactor)
+{
+    uint64_t value;
+    struct Connection *connection;
+
+    while (read(reactor->wake_fd, &value, sizeof(value)) > 0)
+        ;
+
+    mtx_lock(&reactor->lock);
+    connection = reactor->completed;
+    reactor->completed = NULL;
+    mtx_unlock(&reactor->lock);
+
+    while (connection != NULL)
+    {
+        struct Connection *next = connection->next;
+        connection->next = NULL;
+        reactor_write(reactor, connection);
+        connection = next;
+    }
+}
+
+/* Iterative, a pipelined client would otherwise recurse through read and write */
+static void reactor_drain(reactor_t *reactor)
+{
+    while (reactor->ready != NULL)
+    {
+        struct Connection *connection = reactor->ready;
+        reactor->ready = connection->next;
+        connection->next = NULL;
+        reactor_write(reactor, connection);
+    }
+}
+
+/* One more turn each, whoever yields again waits for the next batch */
+static void reactor_resume_deferred(reactor_t *reactor)
+{
+    struct Connection *connection = reactor->deferred;
+    reactor->deferred = NULL;
+
+    while (connection != NULL)
+    {
+        struct Connection *next = connection->next;
+        connection->next = NULL;
+        connection->state = connection_writing;
+        reactor_write(reactor, connection);
+        reactor_drain(reactor);
+        connection = next;
+    }
+}
+
+void reactor_complete(struct Connection *connection)
+{
+    reactor_t *reactor = connection->reactor;
+    int wake;
+
+    /* Inline handlers run on the reactor thread, no lock and no wake-up */
+    if (reactor->pool == NULL)
+    {
+        connection->next = reactor->ready;
+        reactor->ready = connection;
+        return;
+    }
+
+    mtx_lock(&reactor->lock);
+    wake = (reactor->completed == NULL);
+    connection->next = reactor->completed;
+    reactor->completed = connection;
+    mtx_unlock(&reactor->lock);
+
+    /* A non-empty list means a wake-up is already on its way */
+    if (wake)
+    {
+        uint64_t one = 1;
+        if (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            printf(RED "Reactor wake failed: %s...\n" RESET, strerror(errno));
+        }
+    }
+}
+
+int reactor_run(reactor_t *reactor)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!__atomic_load_n(&reactor->stopping, __ATOMIC_ACQUIRE))
+    {
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS,
+                               reactor->deferred != NULL ? 0 : reactor_next_timeout(reactor, now_ms()));
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf(RED "Event loop failed: %s...\n" RESET, strerror(errno));
+            return 1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &reactor->server_fd)
+            {
+                reactor_accept(reactor);
+                continue;
+            }
+            if (ptr == &reactor->wake_fd)
+            {
+                reactor_resume(reactor);
+                continue;
+            }
+
+            struct Connection *connection = (struct Connection *)ptr;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                connection->readable = 1;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                connection->writable = 1;
+            }
+
+            /* Workers own the connection until reactor_complete() */
+            if (connection->state == connection_reading && connection->readable)
+            {
+                reactor_read(reactor, connection);
+                reactor_drain(reactor);
+            }
+            else if (connection->state == connection_writing && connection->writable)
+            {
+                reactor_write(reactor, connection);
+                reactor_drain(reactor);
+            }
+            else if (connection->state == connection_receiving && connection->readable)
+            {
+                reactor_receive(reactor, connection);
+                reactor_drain(reactor);
+            }
+        }
+
+        reactor_resume_deferred(reactor);
+
+        if (reactor->idle_timeout > 0)
+        {
+            reactor_expire(reactor, now_ms());
+        }
+
+        while (reactor->closed != NULL)
+        {
+            struct Connection *next = reactor->closed->next;
+            connection_free(reactor->closed);
+            reactor->closed = next;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "connection.h"
+#include "threadpool.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file reactor.h
+     * @brief Edge-triggered epoll event loop
+     *
+     * The reactor owns every client socket. It accepts, reads until a full
+     * request is buffered, then hands the connection to a worker. The worker
+     * gives it back with reactor_complete() and the reactor finishes any
+     * pending output, then either waits for the next request on the socket
+     * (connection->keep_alive) or closes it. A worker that sets up
+     * connection->upload hands the connection back to have the request
+     * body streamed to disk, after which the handler runs again to answer.
+     * Sockets the reactor owns are closed after idle_timeout milliseconds
+     * without progress.
+     *
+     * Without a pool the handler runs on the reactor thread itself. Several
+     * such reactors, each with its own listener, share nothing on the
+     * request path: no queue, no lock and no wake-up between threads.
+     */
+
+#define REACTOR_MAX_EVENTS 256
+
+    typedef struct reactor_t reactor_t;
+
+    /**
+     * Called on the reactor thread after every read.
+     * Returns 1 when connection->buffer holds a complete request (and sets
+     * connection->request_length), 0 when more data is needed and -1 when
+     * the request can never be served.
+     */
+    typedef int (*reactor_frame_t)(struct Connection *connection);
+
+    /**
+     * @function reactor_create
+     * @brief Creates an event loop around a listening socket.
+     * @param server_fd Listening socket, switched to nonblocking.
+     * @param pool      Pool that runs handler for framed requests, NULL to
+     *                  run it inline on the reactor thread.
+     * @param frame     Request framing callback.
+     * @param handler   Worker routine, receives the struct Connection.
+     * @param idle_timeout Milliseconds a socket may sit idle, 0 for no limit.
+     * @return a newly created reactor or NULL
+     */
+    reactor_t *reactor_create(int server_fd, threadpool_t *pool,
+                              reactor_frame_t frame, void (*handler)(void *),
+                              int idle_timeout);
+
+    /**
+     * @function reactor_run
+     * @brief Runs the event loop on the calling thread.
+     * @return C_ERR style non-zero value if epoll fails, 0 once stopped
+     */
+    int reactor_run(reactor_t *reactor);
+
+    /**
+     * @function reactor_complete
+     * @brief Returns a connection from a worker to its reactor.
+     *
+     * Safe to call from any thread. The worker must not touch the
+     * connection afterwards. An inline handler must call it before
+     * returning.
+     */
+    void reactor_complete(struct Connection *connection);
+
+    /**
+     * @function reactor_stop
+     * @brief Makes reactor_run() return 0 after its current batch of
+     *        events. Safe to call from any thread.
+     */
+    void reactor_stop(reactor_t *reactor);
+
+    /**
+     * @function reactor_destroy
+     * @brief Closes every file descriptor owned by the reactor.
+     */
+    void reactor_destroy(reactor_t *reactor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _REACTOR_H_ */
@@ -0,0 +1,323 @@
+/**
+ * @file response.c
+ * @brief HTTP responses gathered as iovec lists
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tinycthread.h"
+#include "response.h"
+
+#define DATE_SLOTS 4 // a reader copying while the timer laps it this often retries
+
+static const struct
+{
+    int code;
+    const char *reason;
+} statuses[status_count] = {
+    [status_ok] = {200, "OK"},
+    [status_created] = {201, "Created"},
+    [status_partial_content] = {206, "Partial Content"},
+    [status_bad_request] = {400, "Bad Request"},
+    [status_forbidden] = {403, "Forbidden"},
+    [status_not_found] = {404, "Not Found"},
+    [status_method_not_allowed] = {405, "Method Not Allowed"},
+    [status_payload_too_large] = {413, "Payload Too Large"},
+    [status_range_not_satisfiable] = {416, "Range Not Satisfiable"},
+    [status_headers_too_large] = {431, "Request Header Fields Too Large"},
+    [status_internal_server_error] = {500, "Internal Server Error"},
+    [status_service_unavailable] = {503, "Service Unavailable"},
+};
+
+static const char *connection_headers[response_connection_count] = {
+    [response_persistent] = "",
+    [response_keep_alive] = "Connection: keep-alive\r\n",
+    [response_close] = "Connection: close\r\n",
+};
+
+/* Status line, Server and Connection for every combination, rendered once */
+static char *blocks[status_count][response_connection_count];
+static size_t block_lengths[status_count][response_connection_count];
+
+/* The current Date line is date_slots[date_generation % DATE_SLOTS] */
+static char date_slots[DATE_SLOTS][RESPONSE_DATE_SIZE + 1];
+static unsigned date_generation;
+static int date_running;
+static thrd_t date_thread;
+
+static void two_digits(char *out, int value)
+{
+    out[0] = (char)('0' + value / 10);
+    out[1] = (char)('0' + value % 10);
+}
+
+static void date_render(void)
+{
+    static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+
+    /* IMF-fixdate (RFC 9110 section 5.6.7), built by hand so the locale cannot leak in */
+    unsigned generation = __atomic_load_n(&date_generation, __ATOMIC_RELAXED) + 1;
+    char *line = date_slots[generation % DATE_SLOTS];
+    memcpy(line, "Date: ", 6);
+    memcpy(line + 6, days[tm.tm_wday], 3);
+    memcpy(line + 9, ", ", 2);
+    two_digits(line + 11, tm.tm_mday);
+    line[13] = ' ';
+    memcpy(line + 14, months[tm.tm_mon], 3);
+    line[17] = ' ';
+    two_digits(line + 18, (tm.tm_year + 1900) / 100);
+    two_digits(line + 20, (tm.tm_year + 1900) % 100);
+    line[22] = ' ';
+    two_digits(line + 23, tm.tm_hour);
+    line[25] = ':';
+    two_digits(line + 26, tm.tm_min);
+    line[28] = ':';
+    two_digits(line + 29, tm.tm_sec);
+    memcpy(line + 31, " GMT\r\n", 7);
+    __atomic_store_n(&date_generation, generation, __ATOMIC_RELEASE);
+}
+
+static int date_timer(void *arg)
+{
+    (void)arg;
+    while (__atomic_load_n(&date_running, __ATOMIC_ACQUIRE))
+    {
+        /* Wake just after the next second starts */
+        struct timespec now, wait;
+        clock_gettime(CLOCK_REALTIME, &now);
+        wait.tv_sec = 0;
+        wait.tv_nsec = 1000000000L - now.tv_nsec;
+        thrd_sleep(&wait, NULL);
+        date_render();
+    }
+    return 0;
+}
+
+static void date_copy(char *line)
+{
+    unsigned generation;
+    do
+    {
+        generation = __atomic_load_n(&date_generation, __ATOMIC_ACQUIRE);
+        memcpy(line, date_slots[generation % DATE_SLOTS], RESPONSE_DATE_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&date_generation, __ATOMIC_RELAXED) - generation >= DATE_SLOTS - 1);
+}
+
+int response_headers_init(const char *server)
+{
+    for (int i = 0; i < status_count; i++)
+    {
+        for (int j = 0; j < response_connection_count; j++)
+        {
+            char block[256];
+            int n = snprintf(block, sizeof(block), "HTTP/1.1 %d %s\r\nServer: %s\r\n%s",
+                             statuses[i].code, statuses[i].reason, server, connection_headers[j]);
+            if (n < 0 || (size_t)n >= sizeof(block) || (blocks[i][j] = strdup(block)) == NULL)
+            {
+                return -1;
+            }
+            block_lengths[i][j] = n;
+        }
+    }
+
+    date_render();
+    date_running = 1;
+    if (thrd_create(&date_thread, date_timer, NULL) != thrd_success)
+    {
+        date_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void response_headers_destroy(void)
+{
+    if (__atomic_exchange_n(&date_running, 0, __ATOMIC_ACQ_REL))
+    {
+        thrd_join(date_thread, NULL);
+    }
+    for (int i = 0; i < status_count; i++)
+    {
+        for (int j = 0; j < response_connection_count; j++)
+        {
+            free(blocks[i][j]);
+            blocks[i][j] = NULL;
+        }
+    }
+}
+
+void response_init(response_t *response)
+{
+    response->iovcnt = 0;
+    response->body = -1;
+    response->overflow = 0;
+    response->scratch_length = 0;
+}
+
+void response_add(response_t *response, const char *data, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (response->iovcnt == RESPONSE_IOV_MAX)
+    {
+        response->overflow = 1;
+        return;
+    }
+    response->iov[response->iovcnt].iov_base = (void *)data;
+    response->iov[response->iovcnt].iov_len = length;
+    response->iovcnt++;
+}
+
+void response_add_string(response_t *response, const char *string)
+{
+    response_add(response, string, strlen(string));
+}
+
+/* Scratch text written right after the previous scratch slice extends it */
+static void scratch_append(response_t *response, const char *text, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    struct iovec *last = response->iovcnt ? &response->iov[response->iovcnt - 1] : NULL;
+    if (last != NULL && (const char *)last->iov_base + last->iov_len == text)
+    {
+        last->iov_len += length;
+        return;
+    }
+    response_add(response, text, length);
+}
+
+char *response_alloc(response_t *response, size_t size)
+{
+    if (RESPONSE_SCRATCH_SIZE - response->scratch_length < size)
+    {
+        response->overflow = 1;
+        return NULL;
+    }
+    char *space = response->scratch + response->scratch_length;
+    response->scratch_length += size;
+    return space;
+}
+
+void response_copy(response_t *response, const char *data, size_t length)
+{
+    char *text = response_alloc(response, length);
+    if (text != NULL)
+    {
+        memcpy(text, data, length);
+        scratch_append(response, text, length);
+    }
+}
+
+/* Right to left into the end of digits, no format string to interpret */
+static int render_number(char *digits, int size, unsigned long long value)
+{
+    int n = size;
+    do
+    {
+        digits[--n] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    return n;
+}
+
+void response_content_length(response_t *response, unsigned long long length)
+{
+    static const char name[] = "Content-Length: ";
+    char line[sizeof(name) - 1 + 20 + 2];
+    char digits[20];
+    int n = render_number(digits, sizeof(digits), length);
+
+    /* One slice for the whole line */
+    memcpy(line, name, sizeof(name) - 1);
+    memcpy(line + sizeof(name) - 1, digits + n, sizeof(digits) - n);
+    memcpy(line + sizeof(name) - 1 + sizeof(digits) - n, "\r\n", 2);
+    response_copy(response, line, sizeof(name) - 1 + sizeof(digits) - n + 2);
+}
+
+static const char *response_vformat(response_t *response, size_t *length, const char *format, va_list args)
+{
+    char *text = response->scratch + response->scratch_length;
+    size_t room = RESPONSE_SCRATCH_SIZE - response->scratch_length;
+    int n = vsnprintf(text, room, format, args);
+    if (n < 0 || (size_t)n >= room)
+    {
+        response->overflow = 1;
+        return NULL;
+    }
+    response->scratch_length += n;
+    *length = n;
+    return text;
+}
+
+const char *response_format(response_t *response, size_t *length, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    const char *text = response_vformat(response, length, format, args);
+    va_end(args);
+    return text;
+}
+
+void response_printf(response_t *response, const char *format, ...)
+{
+    size_t length;
+    va_list args;
+    va_start(args, format);
+    const char *text = response_vformat(response, &length, format, args);
+    va_end(args);
+    if (text != NULL)
+    {
+        scratch_append(response, text, length);
+    }
+}
+
+void response_status(response_t *response, response_status_t status, response_connection_t connection)
+{
+    response_add(response, blocks[status][connection], block_lengths[status][connection]);
+
+    char *line = response_alloc(response, RESPONSE_DATE_SIZE);
+    if (line != NULL)
+    {
+        date_copy(line);
+        scratch_append(response, line, RESPONSE_DATE_SIZE);
+    }
+}
+
+void response_end_headers(response_t *response)
+{
+    response_add_literal(response, "\r\n");
+    response->body = response->iovcnt;
+}
+
+void response_strip_body(response_t *response)
+{
+    if (response->body >= 0)
+    {
+        response->iovcnt = response->body;
+    }
+}
+
+size_t response_length(const response_t *response)
+{
+    size_t length = 0;
+    for (int i = 0; i < response->iovcnt; i++)
+    {
+        length += response->iov[i].iov_len;
+    }
+    return length;
+}
@@ -0,0 +1,180 @@
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file response.h
+     * @brief HTTP responses gathered as iovec lists
+     *
+     * A response is a list of slices written with one writev()/sendmsg().
+     * Constant header fragments and bodies living in the request buffer or
+     * the file cache are referenced in place. Only what has to be rendered
+     * (numbers, ETags, ranges) is written to a small scratch area in the
+     * response itself, and consecutive rendered pieces share one iovec.
+     * Every slice must stay valid until the response has been sent or
+     * queued.
+     *
+     * Status lines are pre-rendered together with the Server and
+     * Connection headers by response_headers_init(), one block per status
+     * and connection mode. A timer thread re-renders the Date header once
+     * a second and workers copy it without taking a lock.
+     */
+
+#define RESPONSE_IOV_MAX 24
+#define RESPONSE_SCRATCH_SIZE 4096
+#define RESPONSE_DATE_SIZE (sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n") - 1)
+
+    typedef enum
+    {
+        status_ok = 0,
+        status_created,
+        status_partial_content,
+        status_bad_request,
+        status_forbidden,
+        status_not_found,
+        status_method_not_allowed,
+        status_payload_too_large,
+        status_range_not_satisfiable,
+        status_headers_too_large,
+        status_internal_server_error,
+        status_service_unavailable,
+        status_count
+    } response_status_t;
+
+    typedef enum
+    {
+        response_persistent = 0, /* HTTP/1.1 default, nothing to say */
+        response_keep_alive,     /* HTTP/1.0 asked to stay open */
+        response_close,
+        response_connection_count
+    } response_connection_t;
+
+    /**
+     *  @struct response_t
+     *  @brief A response under construction
+     *
+     *  @var iov        Slices in wire order.
+     *  @var body       Index of the first body slice, -1 until
+     *                  response_end_headers() is called.
+     *  @var overflow   A slice or scratch bytes did not fit. The response
+     *                  is incomplete and must not be sent.
+     *  @var scratch    Rendered text referenced by iov.
+     */
+    typedef struct response_t
+    {
+        struct iovec iov[RESPONSE_IOV_MAX];
+        int iovcnt;
+        int body;
+        int overflow;
+        size_t scratch_length;
+        char scratch[RESPONSE_SCRATCH_SIZE];
+    } response_t;
+
+    /**
+     * @function response_init
+     * @brief Empties a response.
+     */
+    void response_init(response_t *response);
+
+    /**
+     * @function response_headers_init
+     * @brief Renders the status blocks with a Server header naming server
+     *        and starts the Date timer.
+     * @return 0 on success, -1 if the timer thread could not start
+     */
+    int response_headers_init(const char *server);
+
+    /**
+     * @function response_headers_destroy
+     * @brief Stops the Date timer.
+     */
+    void response_headers_destroy(void);
+
+    /**
+     * @function response_status
+     * @brief Starts a response: status line, Server, Connection and Date.
+     */
+    void response_status(response_t *response, response_status_t status, response_connection_t connection);
+
+    /**
+     * @function response_add
+     * @brief Appends a slice by reference.
+     */
+    void response_add(response_t *response, const char *data, size_t length);
+
+/* Appends a string literal without measuring it at run time */
+#define response_add_literal(response, literal) response_add((response), (literal), sizeof(literal) - 1)
+
+    /**
+     * @function response_add_string
+     * @brief Appends a NUL terminated string by reference.
+     */
+    void response_add_string(response_t *response, const char *string);
+
+    /**
+     * @function response_copy
+     * @brief Appends a copy of length bytes, for data that does not
+     *        outlive the caller.
+     */
+    void response_copy(response_t *response, const char *data, size_t length);
+
+    /**
+     * @function response_content_length
+     * @brief Appends a Content-Length header for length bytes.
+     */
+    void response_content_length(response_t *response, unsigned long long length);
+
+    /**
+     * @function response_printf
+     * @brief Appends formatted text. Meant for rare, irregular headers
+     *        such as Content-Range, hot paths should use the above.
+     */
+    void response_printf(response_t *response, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    /**
+     * @function response_format
+     * @brief Renders formatted text into scratch without appending it,
+     *        for text sent by other means such as multipart part headers.
+     * @return the text, or NULL when scratch is full
+     */
+    const char *response_format(response_t *response, size_t *length, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+    /**
+     * @function response_alloc
+     * @brief Claims size bytes of scratch without appending them, for
+     *        data produced in place such as compressed bodies.
+     * @return the space, or NULL when scratch is full
+     */
+    char *response_alloc(response_t *response, size_t size);
+
+    /**
+     * @function response_end_headers
+     * @brief Appends the blank line ending the header section. Whatever
+     *        follows is body.
+     */
+    void response_end_headers(response_t *response);
+
+    /**
+     * @function response_strip_body
+     * @brief Drops the body slices, for HEAD.
+     */
+    void response_strip_body(response_t *response);
+
+    /**
+     * @function response_length
+     * @brief Bytes in the response.
+     */
+    size_t response_length(const response_t *response);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RESPONSE_H_ */
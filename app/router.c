@@ -0,0 +1,372 @@
+/**
+ * @file router.c
+ * @brief Method and path routing over a radix trie
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+static const char *method_names[ROUTE_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH"};
+
+/**
+ *  @struct route_node_t
+ *  @brief A radix trie node
+ *
+ *  @var prefix      Static bytes consumed by this node.
+ *  @var indices     First byte of each static child, same order as children.
+ *  @var param       Child matching one ':' segment.
+ *  @var wildcard    Child matching the '*' tail.
+ *  @var methods     Bitmap of methods with a handler on this node.
+ *  @var handlers    Handler per method bit.
+ */
+typedef struct route_node_t
+{
+    char *prefix;
+    size_t prefix_length;
+    char *indices;
+    struct route_node_t **children;
+    int child_count;
+    struct route_node_t *param;
+    struct route_node_t *wildcard;
+    unsigned methods;
+    route_handler_t handlers[ROUTE_METHOD_COUNT];
+} route_node_t;
+
+struct router_t
+{
+    route_node_t *root;
+};
+
+static route_node_t *node_create(const char *prefix, size_t prefix_length)
+{
+    route_node_t *node = (route_node_t *)calloc(1, sizeof(route_node_t));
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->prefix = (char *)malloc(prefix_length + 1);
+    if (node->prefix == NULL)
+    {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->prefix, prefix, prefix_length);
+    node->prefix[prefix_length] = '\0';
+    node->prefix_length = prefix_length;
+    return node;
+}
+
+static void node_destroy(route_node_t *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++)
+    {
+        node_destroy(node->children[i]);
+    }
+    node_destroy(node->param);
+    node_destroy(node->wildcard);
+    free(node->children);
+    free(node->indices);
+    free(node->prefix);
+    free(node);
+}
+
+static int node_append(route_node_t *node, route_node_t *child)
+{
+    route_node_t **children = (route_node_t **)realloc(node->children, sizeof(route_node_t *) * (node->child_count + 1));
+    if (children == NULL)
+    {
+        return -1;
+    }
+    node->children = children;
+
+    char *indices = (char *)realloc(node->indices, node->child_count + 1);
+    if (indices == NULL)
+    {
+        return -1;
+    }
+    node->indices = indices;
+
+    node->children[node->child_count] = child;
+    node->indices[node->child_count] = child->prefix[0];
+    node->child_count++;
+    return 0;
+}
+
+/* Inserts the static run [path, path + length) below node, returns the node that ends it */
+static route_node_t *node_insert_static(route_node_t *node, const char *path, size_t length)
+{
+    while (length > 0)
+    {
+        route_node_t *child = NULL;
+        int index;
+
+        for (index = 0; index < node->child_count; index++)
+        {
+            if (node->indices[index] == path[0])
+            {
+                child = node->children[index];
+                break;
+            }
+        }
+
+        if (child == NULL)
+        {
+            child = node_create(path, length);
+            if (child == NULL || node_append(node, child) != 0)
+            {
+                node_destroy(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->prefix_length && common < length && child->prefix[common] == path[common])
+        {
+            common++;
+        }
+
+        /* Split the child so the shared part becomes its own node */
+        if (common < child->prefix_length)
+        {
+            route_node_t *split = node_create(child->prefix, common);
+            if (split == NULL)
+            {
+                return NULL;
+            }
+            memmove(child->prefix, child->prefix + common, child->prefix_length - common + 1);
+            child->prefix_length -= common;
+            if (node_append(split, child) != 0)
+            {
+                node_destroy(split);
+                return NULL;
+            }
+            node->children[index] = split;
+            child = split;
+        }
+
+        node = child;
+        path += common;
+        length -= common;
+    }
+    return node;
+}
+
+router_t *router_create(void)
+{
+    router_t *router = (router_t *)malloc(sizeof(router_t));
+    if (router == NULL)
+    {
+        return NULL;
+    }
+    router->root = node_create("", 0);
+    if (router->root == NULL)
+    {
+        free(router);
+        return NULL;
+    }
+    return router;
+}
+
+void router_destroy(router_t *router)
+{
+    if (router == NULL)
+    {
+        return;
+    }
+    node_destroy(router->root);
+    free(router);
+}
+
+int router_add(router_t *router, unsigned methods, const char *pattern, route_handler_t handler)
+{
+    route_node_t *node = router->root;
+    const char *p = pattern;
+    int params = 0;
+
+    if (pattern[0] != '/' || methods == 0 || handler == NULL)
+    {
+        return -1;
+    }
+
+    while (*p)
+    {
+        if (*p == ':')
+        {
+            /* One segment, the name is documentation only */
+            while (*p && *p != '/')
+            {
+                p++;
+            }
+            if (++params > ROUTE_MAX_PARAMS)
+            {
+                return -1;
+            }
+            if (node->param == NULL && (node->param = node_create("", 0)) == NULL)
+            {
+                return -1;
+            }
+            node = node->param;
+        }
+        else if (*p == '*')
+        {
+            if (p[1] != '\0' || ++params > ROUTE_MAX_PARAMS)
+            {
+                return -1;
+            }
+            if (node->wildcard == NULL && (node->wildcard = node_create("", 0)) == NULL)
+            {
+                return -1;
+            }
+            node = node->wildcard;
+            p++;
+        }
+        else
+        {
+            size_t length = strcspn(p, ":*");
+            if ((node = node_insert_static(node, p, length)) == NULL)
+            {
+                return -1;
+            }
+            p += length;
+        }
+    }
+
+    if (node->methods & methods)
+    {
+        return -1;
+    }
+    node->methods |= methods;
+    for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+    {
+        if (methods & (1u << i))
+        {
+            node->handlers[i] = handler;
+        }
+    }
+    return 0;
+}
+
+/* Depth-first with backtracking: static, then parameter, then wildcard */
+static const route_node_t *node_match(const route_node_t *node, const char *path, size_t length, route_match_t *match)
+{
+    if (length == 0 && node->methods)
+    {
+        return node;
+    }
+
+    if (length > 0)
+    {
+        for (int i = 0; i < node->child_count; i++)
+        {
+            const route_node_t *child = node->children[i];
+            if (node->indices[i] == path[0] &&
+                child->prefix_length <= length &&
+                memcmp(child->prefix, path, child->prefix_length) == 0)
+            {
+                const route_node_t *found = node_match(child, path + child->prefix_length, length - child->prefix_length, match);
+                if (found)
+                {
+                    return found;
+                }
+                break;
+            }
+        }
+
+        if (node->param)
+        {
+            size_t segment = 0;
+            while (segment < length && path[segment] != '/')
+            {
+                segment++;
+            }
+            if (segment > 0)
+            {
+                match->params[match->param_count].data = path;
+                match->params[match->param_count].length = segment;
+                match->param_count++;
+                const route_node_t *found = node_match(node->param, path + segment, length - segment, match);
+                if (found)
+                {
+                    return found;
+                }
+                match->param_count--;
+            }
+        }
+    }
+
+    if (node->wildcard)
+    {
+        match->params[match->param_count].data = path;
+        match->params[match->param_count].length = length;
+        match->param_count++;
+        return node->wildcard;
+    }
+    return NULL;
+}
+
+unsigned route_method(http_string_t method)
+{
+    for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+    {
+        if (strlen(method_names[i]) == method.length && memcmp(method_names[i], method.data, method.length) == 0)
+        {
+            return 1u << i;
+        }
+    }
+    return 0;
+}
+
+route_status_t router_match(const router_t *router, http_string_t method, http_string_t path, route_match_t *match)
+{
+    unsigned bit = route_method(method);
+
+    match->handler = NULL;
+    match->allowed = 0;
+    match->param_count = 0;
+
+    const route_node_t *node = node_match(router->root, path.data, path.length, match);
+    if (node == NULL)
+    {
+        return route_not_found;
+    }
+
+    match->allowed = node->methods;
+    if (!(node->methods & bit))
+    {
+        return route_method_not_allowed;
+    }
+    match->handler = node->handlers[__builtin_ctz(bit)];
+    return route_found;
+}
+
+void route_allow(unsigned methods, char *buffer, size_t size)
+{
+    size_t used = 0;
+
+    if (size == 0)
+    {
+        return;
+    }
+    buffer[0] = '\0';
+    for (int i = 0; i < ROUTE_METHOD_COUNT; i++)
+    {
+        if (methods & (1u << i))
+        {
+            int n = snprintf(buffer + used, size - used, "%s%s", used ? ", " : "", method_names[i]);
+            if (n < 0 || (size_t)n >= size - used)
+            {
+                return;
+            }
+            used += n;
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include <stddef.h>
+
+#include "parser.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file router.h
+     * @brief Method and path routing over a radix trie
+     *
+     * Routes are registered once at startup and compiled into a radix trie
+     * whose nodes carry a bitmap of the methods registered on them.
+     * Matching walks the path once. Static segments win over parameters
+     * and parameters win over a trailing wildcard.
+     *
+     * Pattern syntax:
+     *   "/user-agent"  exact path
+     *   "/users/:id"   one path segment, captured
+     *   trailing '*'   the rest of the path, possibly empty, captured,
+     *                  e.g. "/echo/" followed by '*'
+     */
+
+#define ROUTE_MAX_PARAMS 4
+
+    typedef enum
+    {
+        route_get = 1 << 0,
+        route_head = 1 << 1,
+        route_post = 1 << 2,
+        route_put = 1 << 3,
+        route_delete = 1 << 4,
+        route_options = 1 << 5,
+        route_patch = 1 << 6
+    } route_method_t;
+
+#define ROUTE_METHOD_COUNT 7
+
+    typedef enum
+    {
+        route_not_found = 0,
+        route_found = 1,
+        route_method_not_allowed = 2
+    } route_status_t;
+
+    struct Request;
+    struct response_t;
+    typedef void (*route_handler_t)(struct response_t *response, struct Request *request);
+
+    /**
+     *  @struct route_match_t
+     *  @brief Result of router_match
+     *
+     *  @var handler     Handler for the method, NULL unless route_found.
+     *  @var allowed     Methods registered on the matched path (for Allow).
+     *  @var params      Captured :param segments, then the wildcard tail.
+     *  @var param_count Entries used in params.
+     */
+    typedef struct
+    {
+        route_handler_t handler;
+        unsigned allowed;
+        http_string_t params[ROUTE_MAX_PARAMS];
+        int param_count;
+    } route_match_t;
+
+    typedef struct router_t router_t;
+
+    /**
+     * @function router_create
+     * @brief Creates an empty route table.
+     */
+    router_t *router_create(void);
+
+    /**
+     * @function router_add
+     * @brief Registers handler for a set of route_method_t bits on pattern.
+     * @return 0 on success, -1 on a malformed pattern, a duplicate route or
+     * allocation failure
+     */
+    int router_add(router_t *router, unsigned methods, const char *pattern, route_handler_t handler);
+
+    /**
+     * @function router_match
+     * @brief Finds the handler for a request. Safe to call from any
+     *        thread once registration is finished.
+     */
+    route_status_t router_match(const router_t *router, http_string_t method, http_string_t path, route_match_t *match);
+
+    /**
+     * @function route_method
+     * @brief Maps a method token to its route_method_t bit, 0 if unknown.
+     */
+    unsigned route_method(http_string_t method);
+
+    /**
+     * @function route_allow
+     * @brief Writes a comma-separated method list for an Allow header.
+     */
+    void route_allow(unsigned methods, char *buffer, size_t size);
+
+    /**
+     * @function router_destroy
+     * @brief Frees the route table.
+     */
+    void router_destroy(router_t *router);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ROUTER_H_ */
@@ -0,0 +1,316 @@
+/**
+ * @file scan.c
+ * @brief Vectorized byte-class scanning for the request parser
+ *
+ * The vector kernels classify 16 or 32 bytes at a time with two nibble
+ * lookup tables: a byte b is a member of a class when
+ * lo[b & 0xf] & hi[b >> 4] is non-zero. With one bit per high nibble this
+ * describes any set of ASCII bytes exactly, so one kernel serves every
+ * class. The SSE4.2 tier uses PCMPESTRI ranges for the delimiter classes,
+ * which fit in a few ranges, and the same lookup (SSSE3) for tokens, which
+ * do not.
+ */
+
+#include <stdint.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+typedef enum
+{
+    class_token = 0,
+    class_target = 1,
+    class_value = 2,
+    class_count = 3
+} scan_class_t;
+
+/**
+ *  @struct scan_table_t
+ *  @brief Per-class tables
+ *
+ *  @var stop   Scalar table, non-zero for bytes that end the token.
+ *  @var lo     Nibble table indexed by the low 4 bits.
+ *  @var hi     Nibble table indexed by the high 4 bits.
+ *  @var invert The nibble tables describe members rather than stop bytes.
+ *  @var ranges PCMPESTRI ranges of stop bytes, ranges_length bytes used.
+ */
+typedef struct
+{
+    unsigned char stop[256];
+    uint8_t lo[16] __attribute__((aligned(16)));
+    uint8_t hi[16] __attribute__((aligned(16)));
+    int invert;
+    char ranges[16] __attribute__((aligned(16)));
+    int ranges_length;
+} scan_table_t;
+
+static scan_table_t tables[class_count];
+
+typedef size_t (*scan_kernel_t)(const char *buffer, size_t length);
+
+static struct
+{
+    scan_kernel_t token;
+    scan_kernel_t target;
+    scan_kernel_t value;
+    scan_level_t level;
+} kernels;
+
+static int is_tchar(int c)
+{
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+    {
+        return 1;
+    }
+    switch (c)
+    {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+    case '+': case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+        return 1;
+    }
+    return 0;
+}
+
+static void table_build(scan_table_t *table, const unsigned char *members, int invert)
+{
+    for (int h = 0; h < 8; h++)
+    {
+        table->hi[h] = (uint8_t)(1 << h);
+    }
+    for (int c = 0; c < 128; c++)
+    {
+        if (members[c])
+        {
+            table->lo[c & 0xf] |= (uint8_t)(1 << (c >> 4));
+        }
+    }
+    table->invert = invert;
+}
+
+static inline size_t scan_scalar_class(const char *buffer, size_t length, const scan_table_t *table)
+{
+    size_t i = 0;
+    while (i < length && !table->stop[(unsigned char)buffer[i]])
+    {
+        i++;
+    }
+    return i;
+}
+
+static size_t scan_token_scalar(const char *buffer, size_t length)
+{
+    return scan_scalar_class(buffer, length, &tables[class_token]);
+}
+
+static size_t scan_target_scalar(const char *buffer, size_t length)
+{
+    return scan_scalar_class(buffer, length, &tables[class_target]);
+}
+
+static size_t scan_value_scalar(const char *buffer, size_t length)
+{
+    return scan_scalar_class(buffer, length, &tables[class_value]);
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("sse4.2"))) static inline size_t scan_lookup_sse(const char *buffer, size_t length, const scan_table_t *table)
+{
+    const __m128i lo = _mm_load_si128((const __m128i *)table->lo);
+    const __m128i hi = _mm_load_si128((const __m128i *)table->hi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const unsigned flip = table->invert ? 0 : 0xffff;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        /* Bits set for bytes outside the table's set */
+        unsigned outside = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128()));
+        unsigned stop = outside ^ flip;
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    return i + scan_scalar_class(buffer + i, length - i, table);
+}
+
+__attribute__((target("sse4.2"))) static inline size_t scan_ranges_sse42(const char *buffer, size_t length, const scan_table_t *table)
+{
+    const __m128i ranges = _mm_load_si128((const __m128i *)table->ranges);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buffer + i));
+        int index = _mm_cmpestri(ranges, table->ranges_length, v, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16)
+        {
+            return i + index;
+        }
+    }
+    return i + scan_scalar_class(buffer + i, length - i, table);
+}
+
+__attribute__((target("sse4.2"))) static size_t scan_token_sse42(const char *buffer, size_t length)
+{
+    return scan_lookup_sse(buffer, length, &tables[class_token]);
+}
+
+__attribute__((target("sse4.2"))) static size_t scan_target_sse42(const char *buffer, size_t length)
+{
+    return scan_ranges_sse42(buffer, length, &tables[class_target]);
+}
+
+__attribute__((target("sse4.2"))) static size_t scan_value_sse42(const char *buffer, size_t length)
+{
+    return scan_ranges_sse42(buffer, length, &tables[class_value]);
+}
+
+__attribute__((target("avx2"))) static inline size_t scan_lookup_avx2(const char *buffer, size_t length, const scan_table_t *table)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)table->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const uint32_t flip = table->invert ? 0 : 0xffffffffu;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        uint32_t outside = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256()));
+        uint32_t stop = outside ^ flip;
+        if (stop)
+        {
+            return i + __builtin_ctz(stop);
+        }
+    }
+    /* Short tails are common, finish them 16 bytes at a time */
+    return i + scan_lookup_sse(buffer + i, length - i, table);
+}
+
+__attribute__((target("avx2"))) static size_t scan_token_avx2(const char *buffer, size_t length)
+{
+    return scan_lookup_avx2(buffer, length, &tables[class_token]);
+}
+
+__attribute__((target("avx2"))) static size_t scan_target_avx2(const char *buffer, size_t length)
+{
+    return scan_lookup_avx2(buffer, length, &tables[class_target]);
+}
+
+__attribute__((target("avx2"))) static size_t scan_value_avx2(const char *buffer, size_t length)
+{
+    return scan_lookup_avx2(buffer, length, &tables[class_value]);
+}
+
+#endif /* SCAN_X86 */
+
+int scan_set_level(scan_level_t level)
+{
+    switch (level)
+    {
+    case scan_scalar:
+        kernels.token = scan_token_scalar;
+        kernels.target = scan_target_scalar;
+        kernels.value = scan_value_scalar;
+        break;
+#ifdef SCAN_X86
+    case scan_sse42:
+        if (!__builtin_cpu_supports("sse4.2"))
+        {
+            return -1;
+        }
+        kernels.token = scan_token_sse42;
+        kernels.target = scan_target_sse42;
+        kernels.value = scan_value_sse42;
+        break;
+    case scan_avx2:
+        if (!__builtin_cpu_supports("avx2"))
+        {
+            return -1;
+        }
+        kernels.token = scan_token_avx2;
+        kernels.target = scan_target_avx2;
+        kernels.value = scan_value_avx2;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    kernels.level = level;
+    return 0;
+}
+
+scan_level_t scan_get_level(void)
+{
+    return kernels.level;
+}
+
+/* Runs before main() and before any worker thread can parse */
+__attribute__((constructor)) static void scan_init(void)
+{
+    unsigned char token[256] = {0}, target[256] = {0}, value[256] = {0};
+
+    for (int c = 0; c < 256; c++)
+    {
+        token[c] = (unsigned char)is_tchar(c);
+        target[c] = (unsigned char)(c <= 0x20 || c == 0x7f);
+        value[c] = (unsigned char)((c < 0x20 && c != '\t') || c == 0x7f);
+
+        tables[class_token].stop[c] = !token[c];
+        tables[class_target].stop[c] = target[c];
+        tables[class_value].stop[c] = value[c];
+    }
+
+    /* Tokens are described by their members, the others by stop bytes */
+    table_build(&tables[class_token], token, 1);
+    table_build(&tables[class_target], target, 0);
+    table_build(&tables[class_value], value, 0);
+
+    static const char target_ranges[] = {0x00, 0x20, 0x7f, 0x7f};
+    static const char value_ranges[] = {0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f};
+    for (size_t i = 0; i < sizeof(target_ranges); i++)
+    {
+        tables[class_target].ranges[i] = target_ranges[i];
+    }
+    tables[class_target].ranges_length = sizeof(target_ranges);
+    for (size_t i = 0; i < sizeof(value_ranges); i++)
+    {
+        tables[class_value].ranges[i] = value_ranges[i];
+    }
+    tables[class_value].ranges_length = sizeof(value_ranges);
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    if (scan_set_level(scan_avx2) != 0 && scan_set_level(scan_sse42) != 0)
+    {
+        scan_set_level(scan_scalar);
+    }
+}
+
+size_t scan_token(const char *buffer, size_t length)
+{
+    return kernels.token(buffer, length);
+}
+
+size_t scan_target(const char *buffer, size_t length)
+{
+    return kernels.target(buffer, length);
+}
+
+size_t scan_value(const char *buffer, size_t length)
+{
+    return kernels.value(buffer, length);
+}
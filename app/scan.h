@@ -0,0 +1,64 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file scan.h
+     * @brief Vectorized byte-class scanning for the request parser
+     *
+     * Each scanner returns the index of the first byte that ends the
+     * current token, or length when every byte belongs to it. The kernel
+     * is picked once at startup from what the CPU supports: AVX2, SSE4.2
+     * or a table-driven scalar loop.
+     */
+
+    typedef enum
+    {
+        scan_scalar = 0,
+        scan_sse42 = 1,
+        scan_avx2 = 2
+    } scan_level_t;
+
+    /**
+     * @function scan_token
+     * @brief Skips RFC 9110 tchar bytes (methods, header names).
+     */
+    size_t scan_token(const char *buffer, size_t length);
+
+    /**
+     * @function scan_target
+     * @brief Skips request-target bytes, stops at SP and control bytes.
+     */
+    size_t scan_target(const char *buffer, size_t length);
+
+    /**
+     * @function scan_value
+     * @brief Skips field-value bytes, stops at CR, LF and other control
+     *        bytes except HTAB.
+     */
+    size_t scan_value(const char *buffer, size_t length);
+
+    /**
+     * @function scan_set_level
+     * @brief Forces a kernel, e.g. to compare them in a benchmark.
+     * @return 0 on success, -1 if the CPU lacks the instructions
+     */
+    int scan_set_level(scan_level_t level);
+
+    /**
+     * @function scan_get_level
+     * @brief Kernel in use.
+     */
+    scan_level_t scan_get_level(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SCAN_H_ */
@@ -7,16 +7,32 @@
 
 #ifdef linux
 #include <sys/socket.h> // internet protocol family
+#include <sys/uio.h>	// vectored i/o
 #include <netinet/in.h> // internet address family
 #include <netinet/ip.h> // internet protocol family
 #include <arpa/inet.h>	// definitions for internet operations
 #include <pthread.h>	// threads
 #include <dirent.h>		// format of directory entries
 #include <unistd.h>		// standard symbolic constants and types
+#include <signal.h>		// signal handling
+#include <strings.h>	// case-insensitive string operations
+#include <fcntl.h>		// file control options
+#include <sys/stat.h>	// file status
+#include <linux/filter.h> // classic bpf for reuseport steering
 #endif
 
 #include <zlib.h> // gzip compression
 #include "threadpool.h"
+#include "reactor.h"
+#include "parser.h"
+#include "headers.h"
+#include "router.h"
+#include "file_cache.h"
+#include "range.h"
+#include "encoding.h"
+#include "response.h"
+#include "arena.h"
+#include "cpu.h"
 #define SIZE 8192
 #define QUEUES 64
 
@@ -26,288 +42,641 @@
 #include <errno.h>	// error return value
 #include <stdint.h> // integer types
 #include <ctype.h>	// character types
+#include <time.h>	// time
 #include "colors.h"
 
-// #define MAX_THREADS 4
-
 #define C_OK 0
 #define C_ERR 1
 #define PORT 4221
+#define SERVER_NAME "codecrafters-http-server"
 #define FLAG_DIRECTORY "--directory"
+#define FLAG_KEEP_ALIVE_REQUESTS "--keep-alive-requests"
+#define FLAG_KEEP_ALIVE_TIMEOUT "--keep-alive-timeout"
+#define FLAG_FILE_CACHE "--file-cache"
+#define FLAG_MAX_UPLOAD "--max-upload"
+#define FLAG_GZIP_LEVEL "--gzip-level"
+#define FLAG_GZIP_MIN_LENGTH "--gzip-min-length"
+#define FLAG_MAX_CONNECTIONS "--max-connections"
+#define FLAG_SCHEDULER "--scheduler"
+#define FLAG_REACTORS "--reactors"
+#define FLAG_STEER "--steer"
+#define FLAG_THREADS "--threads"
+#define FLAG_AFFINITY "--affinity"
+#define FLAG_THREAD_STACK "--thread-stack"
+#define FLAG_MIN_THREADS "--min-threads"
+#define FLAG_THREAD_IDLE "--thread-idle"
+#define FLAG_CODEL_TARGET "--codel-target"
+#define FLAG_CODEL_INTERVAL "--codel-interval"
+
+#define KEEP_ALIVE_REQUESTS 1000 // responses per connection, 0 for no limit
+#define KEEP_ALIVE_TIMEOUT 5000	 // idle milliseconds, 0 for no limit
+#define FILE_CACHE_SIZE 64		 // MiB of small files kept in memory, 0 to disable
+#define FILE_CACHE_MAX_ENTRY (1024 * 1024)
+#define MAX_UPLOAD 0			 // MiB accepted by POST /files/, 0 for no limit
+#define GZIP_LEVEL Z_DEFAULT_COMPRESSION // zlib level for gzip and deflate
+#define GZIP_MIN_LENGTH 0		 // bodies shorter than this are sent uncompressed
+#define MAX_CONNECTIONS 1024	 // open client sockets, preallocated at startup
+#define REACTORS 1				 // event loops with their own listener, 0 for one per core
+#define MAX_REACTORS 256
+#define THREADS 0				 // pool workers, 0 for one per usable cpu
+#define MIN_THREADS 2			 // background compression must not starve requests
+#define THREAD_STACK 0			 // KiB of stack per worker, 0 for the system default
+#define MIN_THREAD_STACK 256	 // KiB, server_process_client alone keeps about 80 on the stack
+#define THREAD_IDLE 10000		 // milliseconds before a spare worker exits
+#define CODEL_TARGET 5			 // milliseconds of standing queue delay before shedding, 0 to disable
+#define CODEL_INTERVAL 100		 // milliseconds the delay has to stay above target
+#define RETRY_AFTER "1"			 // seconds a shed client is asked to wait
 
 #define BUFFER_SIZE 1024
 #define FILE_BUFFER_SIZE 1024
 #define REQEUST_BUFFER_SIZE 1024
-#define RESPONSE_BUFFER_SIZE 4096
+#define PIPELINE_DEPTH 16 // responses batched into one write
+
+#define STATUS_CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
 
-#define STATUS_OK "HTTP/1.1 200 OK\r\n"
-#define STATUS_CREATED "HTTP/1.1 201 Created\r\n\r\n"
-#define STATUS_NOT_FOUND "HTTP/1.1 404 Not Found\r\n\r\n"
-#define STATUS_INTERNAL_SERVER_ERROR "HTTP/1.1 500 Internal Server Error\r\n\r\n"
-#define STATUS_METHOD_NOT_ALLOWED "HTTP/1.1 405 Method Not Allowed\r\n\r\n"
 
-#define CONTENT_LENGTH "Content-Length: "
 #define CONTENT_TYPE_TEXT "Content-Type: text/plain\r\n"
 #define CONTENT_TYPE_FILE "Content-Type: application/octet-stream\r\n"
+#define CONTENT_TYPE_MULTIPART "Content-Type: multipart/byteranges; boundary="
+#define ACCEPT_RANGES "Accept-Ranges: bytes\r\n"
 
 #define CONTENT_ENCODING_GZIP "Content-Encoding: gzip\r\n"
+#define VARY_ACCEPT_ENCODING "Vary: Accept-Encoding\r\n"
+#define TRANSFER_ENCODING_CHUNKED "Transfer-Encoding: chunked\r\n"
 
-#define CLRF "\r\n"
 
-struct ThreadArgs
-{
-	struct sockaddr_in client_addr;
-	int client_fd;
-} ThreadArgs;
+#define CLRF "\r\n"
 
 struct Request
 {
-	char *method;
-	char *path;
-	char *version;
-	char *accept;
-	char *accept_encoding;
-	char *host;
-	char *user_agent;
-	char *content_length;
-	char *body;
-	size_t size;
+	http_string_t method;
+	http_string_t path;
+	http_string_t query;
+	http_string_t version;
+	header_table_t headers;
+	http_string_t body;
+	int streamed;
+	int chunked;
+	int expect_continue;
+	size_t content_length;
+	struct Connection *connection;
+	http_string_t params[ROUTE_MAX_PARAMS];
+	int param_count;
+	int file_fd;
+	connection_part_t parts[RANGE_MAX * 2 + 1];
+	int part_count;
+	const file_entry_t *cached;
+	const encoder_t *encoder;
+	int minor_version;
+	int keep_alive;
 } Request;
 
 char *option_directory = NULL;
+int option_keep_alive_requests = KEEP_ALIVE_REQUESTS;
+int option_keep_alive_timeout = KEEP_ALIVE_TIMEOUT;
+int option_file_cache = FILE_CACHE_SIZE;
+int option_max_upload = MAX_UPLOAD;
+int option_gzip_level = GZIP_LEVEL;
+int option_gzip_min_length = GZIP_MIN_LENGTH;
+int option_max_connections = MAX_CONNECTIONS;
+int option_scheduler = 0; // threadpool_create flags
+int option_reactors = REACTORS;
+int option_steer = 0; // pick the listener by receiving cpu
+int option_threads = THREADS;
+int option_affinity = 0; // threadpool_pin_workers, reactors are always pinned
+int option_thread_stack = THREAD_STACK;
+int option_min_threads = MIN_THREADS; // the pool grows from here to option_threads
+int option_thread_idle = THREAD_IDLE;
+int option_codel_target = CODEL_TARGET;
+int option_codel_interval = CODEL_INTERVAL;
+router_t *router = NULL;
+file_cache_t *file_cache = NULL;
+threadpool_t *thread_pool = NULL;
 
-void strremove(char *s, const char *toremove)
+void request_print(const struct Request *request)
 {
-	while ((s = strstr(s, toremove)))
-		memmove(s, s + strlen(toremove), 1 + strlen(s + strlen(toremove)));
+	printf(YELLOW "%.*s\n" RESET, (int)request->method.length, request->method.data);
+	printf(YELLOW "%.*s\n" RESET, (int)request->path.length, request->path.data);
+	printf(YELLOW "%.*s\n" RESET, (int)request->version.length, request->version.data);
+	for (int i = 0; i < HEADER_KNOWN_COUNT; i++)
+	{
+		if (request->headers.known[i].data)
+		{
+			printf(YELLOW "%s: %.*s\n" RESET, header_names[i], (int)request->headers.known[i].length, request->headers.known[i].data);
+		}
+	}
+	for (int i = 0; i < request->headers.extra_count; i++)
+	{
+		const header_field_t *field = &request->headers.extra[i];
+		printf(YELLOW "%.*s: %.*s\n" RESET, (int)field->name.length, field->name.data, (int)field->value.length, field->value.data);
+	}
+	printf(YELLOW "%.*s\n" RESET, (int)request->body.length, request->body.data);
 }
 
-int compressToGzip(const char *input, int inputSize, char *output, int outputSize)
-{
-	z_stream zs = {0};
-	zs.zalloc = Z_NULL;
-	zs.zfree = Z_NULL;
-	zs.opaque = Z_NULL;
-	zs.avail_in = (uInt)inputSize;
-	zs.next_in = (Bytef *)input;
-	zs.avail_out = (uInt)outputSize;
-	zs.next_out = (Bytef *)output;
-
-	deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
-	deflate(&zs, Z_FINISH);
-	deflateEnd(&zs);
-	return zs.total_out;
+void request_parse(const char *buffer, const http_parser_t *parser, struct Request *request)
+{
+	request->method = http_string(buffer, parser->method);
+	request->path = http_string(buffer, parser->target);
+	request->version = http_string(buffer, parser->version);
+
+	/* Route on the path alone, the query string is kept for handlers */
+	const char *query = memchr(request->path.data, '?', request->path.length);
+	if (query != NULL)
+	{
+		request->query.data = query + 1;
+		request->query.length = request->path.data + request->path.length - query - 1;
+		request->path.length = query - request->path.data;
+	}
+	request->minor_version = parser->minor_version;
+	request->body.data = buffer + parser->header_length;
+	request->body.length = parser->streamed ? 0 : parser->content_length;
+	request->streamed = parser->streamed;
+	request->chunked = parser->chunked;
+	request->expect_continue = parser->expect_continue;
+	request->content_length = parser->content_length;
+	request->file_fd = -1;
+	header_table_build(&request->headers, buffer, parser);
 }
 
-void request_print(const struct Request *request)
+static response_connection_t response_connection(const struct Request *request)
 {
-	printf(YELLOW "%s\n" RESET, request->method);
-	printf(YELLOW "%s\n" RESET, request->path);
-	printf(YELLOW "%s\n" RESET, request->version);
-	printf(YELLOW "%s\n" RESET, request->accept);
-	printf(YELLOW "%s\n" RESET, request->accept_encoding);
-	printf(YELLOW "%s\n" RESET, request->host);
-	printf(YELLOW "%s\n" RESET, request->user_agent);
-	printf(YELLOW "%s\n" RESET, request->content_length);
-	printf(YELLOW "%s\n" RESET, request->body);
+	if (!request->keep_alive)
+	{
+		return response_close;
+	}
+	return request->minor_version == 0 ? response_keep_alive : response_persistent;
 }
 
-void request_parse(char *buffer, struct Request *request)
-{ // TODO: optimize
+/* Pre-rendered status block plus the current Date, every response starts with these */
+static void response_start(response_t *response, const struct Request *request, response_status_t status)
+{
+	response_status(response, status, response_connection(request));
+}
 
-	char *token = strtok(buffer, " ");
-	request->method = token;
-	token = strtok(NULL, " ");
-	request->path = token;
-	token = strtok(NULL, " ");
-	request->version = token;
+static void response_empty(response_t *response, const struct Request *request, response_status_t status)
+{
+	response_start(response, request, status);
+	response_add_literal(response, "Content-Length: 0\r\n");
+	response_end_headers(response);
+}
 
-	token = strtok(NULL, "\r\n");
-	while (token != NULL)
+/* Cached content headers already end with the blank line */
+static void response_cached(response_t *response, struct Request *request, const file_entry_t *entry)
+{
+	response_start(response, request, status_ok);
+	response_add(response, entry->headers, entry->headers_length - 2);
+	response_end_headers(response);
+	response_add(response, entry->data, entry->size);
+	request->cached = entry;
+}
+
+void route_root(response_t *response, struct Request *request)
+{
+	response_empty(response, request, status_ok);
+}
+
+void route_user_agent(response_t *response, struct Request *request)
+{
+	http_string_t user_agent = header_get(&request->headers, header_user_agent);
+	response_start(response, request, status_ok);
+	response_add_literal(response, CONTENT_TYPE_TEXT);
+	response_content_length(response, user_agent.length);
+	response_end_headers(response);
+	response_add(response, user_agent.data, user_agent.length);
+}
+
+void route_echo(response_t *response, struct Request *request)
+{
+	http_string_t echo = request->params[0];
+
+	const encoder_t *encoder = NULL;
+	if (echo.length >= (size_t)option_gzip_min_length)
 	{
+		encoder = encoding_negotiate(header_get(&request->headers, header_accept_encoding), ENCODING_ANY);
+	}
 
-		if (!request->accept)
+	/* Compressed output goes to the response's scratch space, it only has to outlive the send */
+	char *body = NULL;
+	int len = -1;
+	if (encoder != NULL && (body = response_alloc(response, BUFFER_SIZE)) != NULL)
+	{
+		len = encoder->compress(echo.data, echo.length, body, BUFFER_SIZE);
+		if (len < 0)
 		{
-			if (strstr(token, "Accept:") != NULL || strstr(token, "accept:") != NULL)
-			{
-				request->accept = token;
-			}
+			printf(RED "Compression failed: %s...\n" RESET, encoder->name);
 		}
+	}
+
+	response_start(response, request, status_ok);
+	response_add_literal(response, CONTENT_TYPE_TEXT VARY_ACCEPT_ENCODING);
+	if (len >= 0)
+	{
+		response_add_string(response, encoder->header);
+		response_content_length(response, len);
+		response_end_headers(response);
+		response_add(response, body, len);
+	}
+	else
+	{
+		/* Echoed straight out of the request buffer */
+		response_content_length(response, echo.length);
+		response_end_headers(response);
+		response_add(response, echo.data, echo.length);
+	}
+}
 
-		if (!request->accept_encoding)
+static int files_path(char *filepath, size_t size, const struct Request *request)
+{
+	http_string_t name = request->params[0];
+
+	/* Stay inside --directory */
+	if (name.length == 0 || memmem(name.data, name.length, "..", 2) != NULL)
+	{
+		return C_ERR;
+	}
+	int n = snprintf(filepath, size, "%s%.*s",
+					 option_directory ? option_directory : "",
+					 (int)name.length,
+					 name.data);
+	return (n < 0 || (size_t)n >= size) ? C_ERR : C_OK;
+}
+
+/* multipart/byteranges: each range gets a part header, all of it streamed after the response headers */
+static void files_multipart(response_t *response, struct Request *request, const char *etag, const range_t *ranges, int count, off_t size)
+{
+	static unsigned long long boundary_seed;
+	char boundary[20];
+	snprintf(boundary, sizeof(boundary), "%016llx",
+			 __atomic_add_fetch(&boundary_seed, 0x9e3779b97f4a7c15ull ^ (unsigned long long)time(NULL), __ATOMIC_RELAXED));
+
+	long long length = 0;
+	size_t n;
+	const char *text;
+	for (int i = 0; i < count; i++)
+	{
+		text = response_format(response, &n,
+							   "\r\n--%s\r\n%sContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+							   boundary,
+							   CONTENT_TYPE_FILE,
+							   (long long)ranges[i].first,
+							   (long long)ranges[i].last,
+							   (long long)size);
+		if (text == NULL)
 		{
-			if (strstr(token, "Accept-Encoding:") != NULL || strstr(token, "accept-encoding:") != NULL)
-			{
-				request->accept_encoding = token;
-			}
+			return;
 		}
+		request->parts[request->part_count++] = (connection_part_t){text, 0, n};
+		request->parts[request->part_count++] = (connection_part_t){NULL, ranges[i].first, ranges[i].last - ranges[i].first + 1};
+		length += n + (ranges[i].last - ranges[i].first + 1);
+	}
+	text = response_format(response, &n, "\r\n--%s--\r\n", boundary);
+	if (text == NULL)
+	{
+		return;
+	}
+	request->parts[request->part_count++] = (connection_part_t){text, 0, n};
+	length += n;
 
-		if (!request->user_agent)
-		{
+	response_start(response, request, status_partial_content);
+	response_add_literal(response, CONTENT_TYPE_MULTIPART);
+	response_copy(response, boundary, strlen(boundary));
+	response_add_literal(response, "\r\n" ACCEPT_RANGES VARY_ACCEPT_ENCODING "ETag: ");
+	response_copy(response, etag, strlen(etag));
+	response_add_literal(response, "\r\n");
+	response_content_length(response, length);
+	response_end_headers(response);
+}
 
-			if (strstr(token, "User-Agent:") != NULL || strstr(token, "user-agent:") != NULL)
-			{
-				request->user_agent = token;
-			}
-		}
+static void files_compress(void *arg)
+{
+	char *filepath = (char *)arg;
+	file_cache_compress(file_cache, filepath);
+	free(filepath);
+}
+
+/* gzip variant of a file for clients that accept it: cached, queued for compression, or path.gz from disk */
+static int files_get_gzip(response_t *response, struct Request *request, const char *filepath)
+{
+	/* Only gzip variants are stored, but a client ranking identity higher still gets identity */
+	if (encoding_negotiate(header_get(&request->headers, header_accept_encoding), encoding_gzip) == NULL)
+	{
+		return 0;
+	}
 
-		if (!request->host)
+	if (file_cache)
+	{
+		int compress = 0;
+		const file_entry_t *entry = file_cache_get(file_cache, filepath, file_gzip, &compress);
+		if (entry != NULL)
 		{
-			if (strstr(token, "Host:") != NULL || strstr(token, "host:") != NULL)
-			{
-				request->host = token;
-			}
+			response_cached(response, request, entry);
+			return 1;
 		}
-
-		if (strstr(token, "Content-Length:") != NULL || strstr(token, "content-length:") != NULL)
+		if (compress)
 		{
-			request->content_length = token;
+			/* This request gets the identity body, later ones the compressed copy */
+			char *path = strdup(filepath);
+			if (path == NULL || threadpool_add(thread_pool, files_compress, path, 0) != 0)
+			{
+				/* Left pending, the placeholder would keep every later request on identity */
+				file_cache_abandon(file_cache, filepath);
+				free(path);
+			}
+			return 0;
 		}
-		else
+		if (errno != EFBIG)
 		{
-			request->body = token;
+			return 0;
 		}
+	}
 
-		token = strtok(NULL, "\r\n");
+	/* A sibling too large for the cache is streamed like any other file */
+	char gzpath[1024 + 3];
+	struct stat st;
+	snprintf(gzpath, sizeof(gzpath), "%s.gz", filepath);
+	int fd = open(gzpath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		return 0;
 	}
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return 0;
+	}
+
+	char etag[FILE_ETAG_SIZE];
+	file_etag(etag, sizeof(etag), &st);
+
+	request->file_fd = fd;
+	response_start(response, request, status_ok);
+	response_add_literal(response, CONTENT_TYPE_FILE CONTENT_ENCODING_GZIP VARY_ACCEPT_ENCODING "ETag: ");
+	response_copy(response, etag, strlen(etag) - 1);
+	response_add_literal(response, "-gz\"\r\n");
+	response_content_length(response, st.st_size);
+	response_end_headers(response);
+	if (st.st_size > 0)
+	{
+		request->parts[request->part_count++] = (connection_part_t){NULL, 0, st.st_size};
+	}
+	return 1;
 }
 
-void response_build(char *buffer, struct Request *request)
-{ // TODO: optimize
+/* Files too large for a cached variant are encoded on the fly, their length is only known at the end */
+static int files_get_encoded(response_t *response, struct Request *request, const char *etag, const struct stat *st)
+{
+	if (request->minor_version < 1 || st->st_size == 0 || st->st_size < option_gzip_min_length ||
+		(file_cache && st->st_size <= FILE_CACHE_MAX_ENTRY))
+	{
+		return 0;
+	}
+	const encoder_t *encoder = encoding_negotiate(header_get(&request->headers, header_accept_encoding), ENCODING_ANY);
+	if (encoder == NULL)
+	{
+		return 0;
+	}
 
-	// printf(CYAN "Request Buffer:\n" YELLOW "%s\n" RESET, buffer); // debug null
+	/* Encoder output is not byte-stable across levels, so the validator is weak */
+	response_start(response, request, status_ok);
+	response_add_literal(response, CONTENT_TYPE_FILE);
+	response_add_string(response, encoder->header);
+	response_add_literal(response, VARY_ACCEPT_ENCODING "ETag: W/");
+	response_copy(response, etag, strlen(etag) - 1);
+	response_printf(response, "-%s\"\r\n", encoder->name);
+	response_add_literal(response, TRANSFER_ENCODING_CHUNKED);
+	response_end_headers(response);
+	request->encoder = encoder;
+	return 1;
+}
 
-	if (!request->path)
+void route_files_get(response_t *response, struct Request *request)
+{
+	char filepath[1024] = {0};
+	struct stat st;
+	int fd = -1;
+
+	if (files_path(filepath, sizeof(filepath), request) != C_OK)
 	{
-		sprintf(buffer,
-				"%s",
-				STATUS_INTERNAL_SERVER_ERROR);
+		response_empty(response, request, status_not_found);
+		return;
 	}
-	else if (strcmp(request->path, "/") == 0)
+
+	/* Hot small files come from memory, anything else is streamed from disk.
+	   Ranges mostly come from resumed downloads of large files and always take the disk path. */
+	http_string_t range = header_get(&request->headers, header_range);
+	if (!range.data && files_get_gzip(response, request, filepath))
 	{
-		sprintf(buffer,
-				"%s%s",
-				STATUS_OK,
-				CLRF);
+		return;
 	}
-	else if (strstr(request->path, "/user-agent") != NULL)
+	const file_entry_t *entry = NULL;
+	int compress = 0;
+	if (file_cache && !range.data)
 	{
-		strremove(request->user_agent, "user-agent: ");
-		strremove(request->user_agent, "User-Agent: ");
-		sprintf(buffer,
-				"%s%s%s%zd\r\n\r\n%s\r\n",
-				STATUS_OK,
-				CONTENT_TYPE_TEXT,
-				CONTENT_LENGTH,
-				strlen(request->user_agent),
-				request->user_agent);
+		entry = file_cache_get(file_cache, filepath, file_identity, &compress);
 	}
-	else if (strstr(request->path, "/echo/") != NULL)
+	if (entry != NULL)
 	{
-		if (request->accept_encoding && strstr(request->accept_encoding, "gzip") != NULL)
-		{
-			strremove(request->path, "/echo/");
+		response_cached(response, request, entry);
+		return;
+	}
 
-			char body[BUFFER_SIZE];
-			int len = compressToGzip(request->path, strlen(request->path), body, 1024);
-			if (len < 0)
-			{
-				printf(RED "Compression failed: %s...\n" RESET, strerror(errno));
-			}
+	fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd != -1 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))
+	{
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+	{
+		response_empty(response, request, status_not_found);
+		return;
+	}
 
-			sprintf(buffer,
-					"%s%s%s%s%d\r\n\r\n",
-					STATUS_OK,
-					CONTENT_TYPE_TEXT,
-					CONTENT_ENCODING_GZIP,
-					CONTENT_LENGTH,
-					len);
+	char etag[FILE_ETAG_SIZE];
+	file_etag(etag, sizeof(etag), &st);
 
-			memcpy(buffer + strlen(buffer), body, len);
-			request->size = len;
-		}
-		else
+	/* If-Range only ever matches our ETag, a date means the client's copy is stale */
+	range_t ranges[RANGE_MAX];
+	int count = 0;
+	range_status_t status = range_none;
+	http_string_t if_range = header_get(&request->headers, header_if_range);
+	if (range.data && (!if_range.data || (if_range.length == strlen(etag) && memcmp(if_range.data, etag, if_range.length) == 0)))
+	{
+		status = range_parse(range, st.st_size, ranges, &count);
+	}
+
+	/* Only the headers are built here, the body goes out with sendfile() */
+	request->file_fd = fd;
+	if (!range.data && files_get_encoded(response, request, etag, &st))
+	{
+		return;
+	}
+	if (status == range_unsatisfiable)
+	{
+		response_start(response, request, status_range_not_satisfiable);
+		response_printf(response, "Content-Range: bytes */%lld\r\n", (long long)st.st_size);
+		response_add_literal(response, "Content-Length: 0\r\n");
+		response_end_headers(response);
+	}
+	else if (status == range_satisfiable && count > 1)
+	{
+		files_multipart(response, request, etag, ranges, count, st.st_size);
+	}
+	else if (status == range_satisfiable)
+	{
+		response_start(response, request, status_partial_content);
+		response_add_literal(response, CONTENT_TYPE_FILE ACCEPT_RANGES VARY_ACCEPT_ENCODING "ETag: ");
+		response_copy(response, etag, strlen(etag));
+		response_printf(response, "\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+						(long long)ranges[0].first,
+						(long long)ranges[0].last,
+						(long long)st.st_size);
+		response_content_length(response, ranges[0].last - ranges[0].first + 1);
+		response_end_headers(response);
+		request->parts[request->part_count++] = (connection_part_t){NULL, ranges[0].first, ranges[0].last - ranges[0].first + 1};
+	}
+	else
+	{
+		response_start(response, request, status_ok);
+		response_add_literal(response, CONTENT_TYPE_FILE ACCEPT_RANGES VARY_ACCEPT_ENCODING "ETag: ");
+		response_copy(response, etag, strlen(etag));
+		response_add_literal(response, "\r\n");
+		response_content_length(response, st.st_size);
+		response_end_headers(response);
+		if (st.st_size > 0)
 		{
-			strremove(request->path, "/echo/");
-			sprintf(buffer,
-					"%s%s%s%zd\r\n\r\n%s\r\n",
-					STATUS_OK,
-					CONTENT_TYPE_TEXT,
-					CONTENT_LENGTH,
-					strlen(request->path),
-					request->path);
+			request->parts[request->part_count++] = (connection_part_t){NULL, 0, st.st_size};
 		}
 	}
-	else if (strstr(request->path, "/files/") != NULL)
+}
+
+void route_files_post(response_t *response, struct Request *request)
+{
+	char filepath[1024] = {0};
+	FILE *file_prt = NULL;
+	unsigned long long limit = (unsigned long long)option_max_upload * 1024 * 1024;
+
+	/* Rejections go out before the client sends a streamed body */
+	response_status_t status = status_count;
+	if (files_path(filepath, sizeof(filepath), request) != C_OK)
+	{
+		status = status_forbidden;
+	}
+	else if (limit && !request->chunked && request->content_length > limit)
+	{
+		status = status_payload_too_large;
+	}
+	if (status != status_count)
 	{
+		response_empty(response, request, status);
+		return;
+	}
 
-		if (strstr(request->method, "GET") != NULL) // GET
+	/* Large, chunked or Expect: 100-continue bodies are spliced to disk by the reactor */
+	if (request->streamed)
+	{
+		if (upload_start(&request->connection->upload, &request->connection->arena, filepath, request->chunked, request->content_length, limit) != 0)
 		{
-			char filepath[1024] = {0};
-			request->path++; // move pointer forward one
-			strcat(filepath, option_directory);
-			strcat(filepath, request->path);
-			strremove(filepath, "files/");
-
-			FILE *file_ptr = fopen(filepath, "r");
-			if (file_ptr != NULL)
-			{
-				fseek(file_ptr, 0, SEEK_END);
-				int size = ftell(file_ptr);
-				char data[1000] = {0};
-				fseek(file_ptr, 0, SEEK_SET);
-				fread(data, sizeof(char), size, file_ptr);
-				fclose(file_ptr);
-
-				sprintf(buffer,
-						"%s%s%s%d\r\n\r\n%s\r\n",
-						STATUS_OK,
-						CONTENT_TYPE_FILE,
-						CONTENT_LENGTH,
-						size,
-						data);
-			}
-			else
-			{
-				sprintf(buffer,
-						"%s",
-						STATUS_NOT_FOUND);
-			}
+			printf(RED "Upload failed: %s...\n" RESET, strerror(errno));
+			response_empty(response, request, status_internal_server_error);
+			return;
 		}
-		else if (strstr(request->method, "POST") != NULL) // POST
+		/* HTTP/1.0 clients do not know 100 Continue (RFC 9110 section 15.2) */
+		if (request->expect_continue && request->minor_version > 0)
 		{
-			char filepath[1024] = {0};
-			request->path++; // move pointer forward one
-			strcat(filepath, option_directory);
-			strcat(filepath, request->path);
-			strremove(filepath, "files/");
+			response_add_literal(response, STATUS_CONTINUE);
+		}
+		return;
+	}
+
+	/* A short write or a failed flush leaves a truncated file, not a created one */
+	int stored = 0;
+	file_prt = fopen(filepath, "w");
+	if (file_prt != NULL)
+	{
+		stored = fwrite(request->body.data, sizeof(char), request->body.length, file_prt) == request->body.length;
+		stored = fclose(file_prt) == 0 && stored;
+	}
+	if (!stored)
+	{
+		printf(RED "File write failed: %s...\n" RESET, strerror(errno));
+	}
+
+	response_empty(response, request, stored ? status_created : status_internal_server_error);
+}
 
-			FILE *file_prt;
-			file_prt = fopen(filepath, "w");
-			fprintf(file_prt, request->body);
-			fclose(file_prt);
+int routes_register(router_t *router)
+{
+	if (router_add(router, route_get | route_head, "/", route_root) != 0 ||
+		router_add(router, route_get | route_head, "/user-agent", route_user_agent) != 0 ||
+		router_add(router, route_get | route_head, "/echo/*", route_echo) != 0 ||
+		router_add(router, route_get | route_head, "/files/*", route_files_get) != 0 ||
+		router_add(router, route_post, "/files/*", route_files_post) != 0)
+	{
+		return C_ERR;
+	}
+	return C_OK;
+}
 
-			sprintf(buffer,
-					"%s",
-					STATUS_CREATED);
+/* Gives back the file and cache entry a handler attached to its response */
+static void response_discard_body(struct Request *request)
+{
+	if (request->file_fd != -1)
+	{
+		close(request->file_fd);
+		request->file_fd = -1;
+		request->part_count = 0;
+		request->encoder = NULL;
+	}
+	if (request->cached != NULL)
+	{
+		file_cache_release(file_cache, request->cached);
+		request->cached = NULL;
+	}
+}
+
+void response_build(response_t *response, struct Request *request)
+{
+	route_match_t match;
+
+	switch (router_match(router, request->method, request->path, &match))
+	{
+	case route_found:
+		memcpy(request->params, match.params, sizeof(match.params));
+		request->param_count = match.param_count;
+		match.handler(response, request);
+		if (response->overflow)
+		{
+			printf(RED "Response too large...\n" RESET);
+			response_discard_body(request);
+			response_init(response);
+			response_empty(response, request, status_internal_server_error);
 		}
-		else
+		else if (route_method(request->method) == route_head)
 		{
-			sprintf(buffer,
-					"%s",
-					STATUS_METHOD_NOT_ALLOWED);
+			/* Same headers as GET, no body */
+			response_strip_body(response);
+			response_discard_body(request);
 		}
-	}
-	else
+		break;
+	case route_method_not_allowed:
 	{
-		sprintf(buffer,
-				"%s",
-				STATUS_NOT_FOUND);
+		char allow[64];
+		route_allow(match.allowed, allow, sizeof(allow));
+		response_start(response, request, status_method_not_allowed);
+		response_add_literal(response, "Allow: ");
+		response_copy(response, allow, strlen(allow));
+		response_add_literal(response, "\r\nContent-Length: 0\r\n");
+		response_end_headers(response);
+		break;
+	}
+	default:
+		response_empty(response, request, status_not_found);
 	}
 }
 
 #ifdef linux
-int server_listen()
+int server_listen(int reuseport)
 {
 	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (server_fd == -1)
@@ -322,6 +691,12 @@ int server_listen()
 		printf(RED "SO_REUSEPORT failed: %s \n" RESET, strerror(errno));
 		return C_ERR;
 	}
+	/* Every reactor binds the same port, the kernel spreads connections */
+	if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+	{
+		printf(RED "SO_REUSEPORT failed: %s \n" RESET, strerror(errno));
+		return C_ERR;
+	}
 
 	struct sockaddr_in serv_addr = {
 		.sin_family = AF_INET,
@@ -334,8 +709,7 @@ int server_listen()
 		return C_ERR;
 	}
 
-	int connection_backlog = 5;
-	if (listen(server_fd, connection_backlog) != 0)
+	if (listen(server_fd, SOMAXCONN) != 0)
 	{
 		printf(RED "Listen failed: %s \n" RESET, strerror(errno));
 		return C_ERR;
@@ -344,8 +718,37 @@ int server_listen()
 
 	return server_fd;
 }
+
+/* Connection goes to the listener whose reactor is pinned to the receiving cpu, cpu % count for any other */
+int server_steer(int server_fd, int count, const int *cpu_ids, int cpus)
+{
+	/* One compare and return per pinned cpu, reactors past the cpu count share one and get nothing steered */
+	struct sock_filter code[2 * MAX_REACTORS + 3];
+	int pinned = count < cpus ? count : cpus;
+	int length = 0;
+
+	code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (int i = 0; i < pinned; i++)
+	{
+		code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)cpu_ids[i], 0, 1);
+		code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned)i);
+	}
+	code[length++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned)count);
+	code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	struct sock_fprog program = {
+		.len = (unsigned short)length,
+		.filter = code,
+	};
+	if (setsockopt(server_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) != 0)
+	{
+		printf(RED "Steering failed: %s \n" RESET, strerror(errno));
+		return C_ERR;
+	}
+	return C_OK;
+}
 #elif _WIN32
-SOCKET server_listen()
+SOCKET server_listen(int reuseport)
 {
 	WSADATA wsaData;
 	int ierror = WSAStartup(MAKEWORD(2, 2), &wsaData);
@@ -388,81 +791,549 @@ SOCKET server_listen()
 }
 #endif
 
-void server_process_client(void *arg)
+/* Requests that cannot be framed get an error and the connection is closed */
+static void request_reject(struct Connection *connection, response_status_t status)
+{
+	response_t response;
+	response_init(&response);
+	response_status(&response, status, response_close);
+	response_add_literal(&response, "Content-Length: 0\r\n");
+	response_end_headers(&response);
+	connection_sendv(connection, response.iov, response.iovcnt);
+}
+
+int request_frame(struct Connection *connection)
+{
+	/* The previous request on this socket was answered, start over */
+	if (http_parser_done(&connection->parser))
+	{
+		http_parser_init(&connection->parser);
+	}
+
+	switch (http_parse(&connection->parser, connection->buffer, connection->length))
+	{
+	case http_parse_complete:
+		connection->request_length = connection->parser.length;
+		return 1;
+	case http_parse_again:
+		/* Bodies that do not fit, or that wait for 100 Continue, are read by the handler */
+		if (connection->parser.header_length &&
+			(connection->parser.expect_continue || connection->parser.length > CONNECTION_BUFFER_SIZE))
+		{
+			http_parser_detach_body(&connection->parser);
+			connection->request_length = connection->parser.length;
+			return 1;
+		}
+		if (connection->length < CONNECTION_BUFFER_SIZE)
+		{
+			return 0;
+		}
+		request_reject(connection, connection->parser.header_length ? status_payload_too_large : status_headers_too_large);
+		return -1;
+	default:
+		request_reject(connection, status_bad_request);
+		return -1;
+	}
+}
+
+void server_process_request(struct Connection *connection, const char *request_buffer, const http_parser_t *parser, response_t *response, struct Request *request)
 {
-	struct ThreadArgs *thread_args = (struct ThreadArgs *)(arg);
-	char response_buffer[RESPONSE_BUFFER_SIZE];
-	char request_buffer[REQEUST_BUFFER_SIZE];
+	memset(request, 0, sizeof(struct Request));
+	request_parse(request_buffer, parser, request);
+	request->connection = connection;
+
+	/* HTTP/1.1 defaults to persistent connections, HTTP/1.0 has to ask */
+	http_string_t connection_header = header_get(&request->headers, header_connection);
+	connection->requests++;
+	if (request->minor_version == 0)
+	{
+		request->keep_alive = connection_header.data && http_token_contains(connection_header.data, connection_header.length, "keep-alive");
+	}
+	else
+	{
+		request->keep_alive = !connection_header.data || !http_token_contains(connection_header.data, connection_header.length, "close");
+	}
+	if (option_keep_alive_requests > 0 && connection->requests >= option_keep_alive_requests)
+	{
+		request->keep_alive = 0;
+	}
+	/* A streamed body nobody takes is left unread, the socket cannot be reused */
+	int keep_alive = request->keep_alive;
+	if (request->streamed)
+	{
+		request->keep_alive = 0;
+	}
+	connection->keep_alive = request->keep_alive;
 
-	if (recv(thread_args->client_fd, request_buffer, sizeof(request_buffer), 0) == -1)
+	response_init(response);
+	response_build(response, request);
+	if (connection->upload.state != upload_idle)
 	{
-		printf(RED "Recieved failed: %s...\n" RESET, strerror(errno));
+		connection->keep_alive = keep_alive;
 	}
-	// printf(CYAN "Request Buffer:\n" YELLOW "%s\n" RESET, request_buffer);
 
+	// request_print(request);
+}
+
+/* Second half of a streamed upload: the reactor stored the body, answer it */
+void server_process_upload(struct Connection *connection)
+{
+	response_t response;
 	struct Request request;
-	request_parse(request_buffer, &request);
-	response_build(response_buffer, &request);
+	response_status_t status = status_created;
 
-	// request_print(&request);
-	// printf(CYAN "Response Buffer:\n" YELLOW "%s\n" RESET, response_buffer);
+	/* A chunked body only shows its size on the way in, the rest of it is never read */
+	if (connection->upload.state == upload_too_large)
+	{
+		upload_abort(&connection->upload);
+		connection->keep_alive = 0;
+		status = status_payload_too_large;
+	}
+	else if (upload_commit(&connection->upload) != 0)
+	{
+		printf(RED "Upload failed: %s...\n" RESET, strerror(errno));
+		status = status_internal_server_error;
+	}
+	request.keep_alive = connection->keep_alive;
+	request.minor_version = connection->parser.minor_version;
+	response_init(&response);
+	response_empty(&response, &request, status);
+	if (connection_sendv(connection, response.iov, response.iovcnt) == -1)
+	{
+		connection->keep_alive = 0;
+	}
+	reactor_complete(connection);
+}
 
-	if (send(thread_args->client_fd, response_buffer, strlen(response_buffer) + request.size, 0) == -1)
+void server_process_client(void *arg)
+{
+	struct Connection *connection = (struct Connection *)(arg);
+	if (connection->upload.state == upload_done || connection->upload.state == upload_too_large)
+	{
+		server_process_upload(connection);
+		return;
+	}
+
+	/* The previous response has been sent, nothing in the arena is referenced any more */
+	arena_reset(&connection->arena);
+
+	response_t responses[PIPELINE_DEPTH];
+	struct iovec iov[PIPELINE_DEPTH * RESPONSE_IOV_MAX];
+	const file_entry_t *cached[PIPELINE_DEPTH];
+	int cached_count = 0;
+	int iovcnt = 0;
+	http_parser_t pipelined;
+	http_parser_t *parser = &connection->parser;
+	struct Request request;
+	size_t offset = 0;
+	int count = 0;
+
+	/* Answer every complete request already buffered, in order, with one write */
+	for (;;)
+	{
+		response_t *response = &responses[count];
+		server_process_request(connection, connection->buffer + offset, parser, response, &request);
+		/* Bodies still point into the request buffer or the cache, nothing is copied here */
+		memcpy(iov + iovcnt, response->iov, response->iovcnt * sizeof(struct iovec));
+		iovcnt += response->iovcnt;
+		if (request.cached != NULL)
+		{
+			cached[cached_count++] = request.cached;
+		}
+		offset += parser->length;
+		count++;
+
+		/* A file body has to be the last thing queued on the socket */
+		if (count == PIPELINE_DEPTH || !connection->keep_alive || request.file_fd != -1 ||
+			connection->upload.state != upload_idle)
+		{
+			break;
+		}
+		parser = &pipelined;
+		http_parser_init(parser);
+		/* Chunked bodies are only streamed for the request the reactor framed */
+		if (http_parse(parser, connection->buffer + offset, connection->length - offset) != http_parse_complete ||
+			parser->streamed)
+		{
+			break;
+		}
+	}
+	connection->request_length = offset;
+
+	int sent;
+	if (request.encoder != NULL)
+	{
+		sent = connection_sendstream(connection, iov, iovcnt, request.file_fd, request.encoder);
+	}
+	else if (request.file_fd != -1)
+	{
+		sent = connection_sendfile(connection, iov, iovcnt, request.file_fd, request.parts, request.part_count);
+	}
+	else
+	{
+		sent = connection_sendv(connection, iov, iovcnt);
+	}
+	/* Whatever the socket did not take was copied, the entries can go */
+	for (int i = 0; i < cached_count; i++)
+	{
+		file_cache_release(file_cache, cached[i]);
+	}
+	if (sent == -1)
 	{
 		printf(RED "Send failed: %s...\n" RESET, strerror(errno));
+		connection->keep_alive = 0;
 	}
-	// printf(GREEN "Message sent: %s:%d <----------\n" RESET, inet_ntoa(thread_args->client_addr.sin_addr), ntohs(thread_args->client_addr.sin_port));
+	// printf(GREEN "Message sent: %s:%d <----------\n" RESET, inet_ntoa(connection->client_addr.sin_addr), ntohs(connection->client_addr.sin_port));
+	reactor_complete(connection);
+}
+
+/* Admission control refused the request, answer without doing the work */
+void server_shed(void *arg)
+{
+	struct Connection *connection = (struct Connection *)arg;
+	/* The body is already on disk, finishing is cheaper than losing it */
+	if (connection->upload.state == upload_done || connection->upload.state == upload_too_large)
+	{
+		server_process_upload(connection);
+		return;
+	}
+
+	response_t response;
+	response_init(&response);
+	response_status(&response, status_service_unavailable, response_close);
+	response_add_literal(&response, "Retry-After: " RETRY_AFTER "\r\nContent-Length: 0\r\n");
+	response_end_headers(&response);
+	connection->keep_alive = 0;
+	connection_sendv(connection, response.iov, response.iovcnt);
+	reactor_complete(connection);
+}
+
 #ifdef linux
-	close(thread_args->client_fd);
-#elif _WIN32
-	closesocket(thread_args->client_fd);
-#endif
+typedef struct
+{
+	reactor_t *reactor;
+	int server_fd;
+	int cpu;
+} server_reactor_t;
+
+int server_reactor_run(void *arg)
+{
+	server_reactor_t *self = (server_reactor_t *)arg;
+	if (cpu_pin(self->cpu) != 0)
+	{
+		printf(RED "Reactor pinning failed: cpu %d, %s...\n" RESET, self->cpu, strerror(errno));
+	}
+	return reactor_run(self->reactor);
 }
 
+/* Shared nothing: each reactor accepts on its own listener and answers on its own thread */
+int server_run_reactors(int count)
+{
+	server_reactor_t reactors[MAX_REACTORS];
+	thrd_t threads[MAX_REACTORS];
+	int cpu_ids[CPU_MAX];
+	int cpus = cpu_list(cpu_ids, CPU_MAX);
+	int created = 0;
+	int started = 1;
+	int status = C_OK;
+
+	for (; created < count; created++)
+	{
+		server_reactor_t *self = &reactors[created];
+		self->server_fd = server_listen(1);
+		if (self->server_fd == C_ERR)
+		{
+			status = C_ERR;
+			break;
+		}
+		self->cpu = cpu_ids[created % cpus];
+		self->reactor = reactor_create(self->server_fd, NULL, request_frame, server_process_client, option_keep_alive_timeout);
+		if (self->reactor == NULL)
+		{
+			close(self->server_fd);
+			status = C_ERR;
+			break;
+		}
+	}
+	/* Without the program the kernel still spreads connections by hash, only locality is lost */
+	int steered = 0;
+	if (status == C_OK && option_steer)
+	{
+		steered = server_steer(reactors[0].server_fd, count, cpu_ids, cpus) == C_OK;
+	}
+	printf(GREEN "Reactors created: %d, %d cpus%s\n" RESET, created, cpus,
+		   steered ? ", steered by cpu" : option_steer ? ", steering failed, spread by hash" : "");
+
+	/* Reactor 0 runs on the calling thread */
+	for (; status == C_OK && started < count; started++)
+	{
+		if (thrd_create(&threads[started], server_reactor_run, &reactors[started]) != thrd_success)
+		{
+			printf(RED "Reactor thread creation failed...\n" RESET);
+			status = C_ERR;
+			break;
+		}
+	}
+	if (status == C_OK)
+	{
+		server_reactor_run(&reactors[0]);
+	}
+
+	/* Started reactors only return once told to, or the joins never finish */
+	for (int i = 1; i < started; i++)
+	{
+		reactor_stop(reactors[i].reactor);
+		thrd_join(threads[i], NULL);
+	}
+	for (int i = 0; i < created; i++)
+	{
+		reactor_destroy(reactors[i].reactor);
+		close(reactors[i].server_fd);
+	}
+	return status;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
-	if (argv[1] != NULL)
+	for (int i = 1; i + 1 < argc; i += 2)
 	{
-		if (strcmp(argv[1], FLAG_DIRECTORY) == 0)
+		if (strcmp(argv[i], FLAG_DIRECTORY) == 0)
 		{
-			option_directory = argv[2];
+			option_directory = argv[i + 1];
 			printf(YELLOW "Directory path set: " RESET "%s\n", option_directory);
 		}
+		else if (strcmp(argv[i], FLAG_KEEP_ALIVE_REQUESTS) == 0)
+		{
+			option_keep_alive_requests = atoi(argv[i + 1]);
+			printf(YELLOW "Keep-alive requests set: " RESET "%d\n", option_keep_alive_requests);
+		}
+		else if (strcmp(argv[i], FLAG_KEEP_ALIVE_TIMEOUT) == 0)
+		{
+			option_keep_alive_timeout = atoi(argv[i + 1]);
+			printf(YELLOW "Keep-alive timeout set: " RESET "%dms\n", option_keep_alive_timeout);
+		}
+		else if (strcmp(argv[i], FLAG_MAX_UPLOAD) == 0)
+		{
+			option_max_upload = atoi(argv[i + 1]);
+			printf(YELLOW "Max upload set: " RESET "%dMiB\n", option_max_upload);
+		}
+		else if (strcmp(argv[i], FLAG_FILE_CACHE) == 0)
+		{
+			option_file_cache = atoi(argv[i + 1]);
+			printf(YELLOW "File cache set: " RESET "%dMiB\n", option_file_cache);
+		}
+		else if (strcmp(argv[i], FLAG_GZIP_LEVEL) == 0)
+		{
+			option_gzip_level = atoi(argv[i + 1]);
+			if (option_gzip_level < Z_DEFAULT_COMPRESSION || option_gzip_level > Z_BEST_COMPRESSION)
+			{
+				option_gzip_level = GZIP_LEVEL;
+			}
+			printf(YELLOW "Gzip level set: " RESET "%d\n", option_gzip_level);
+		}
+		else if (strcmp(argv[i], FLAG_GZIP_MIN_LENGTH) == 0)
+		{
+			option_gzip_min_length = atoi(argv[i + 1]);
+			printf(YELLOW "Gzip min length set: " RESET "%d bytes\n", option_gzip_min_length);
+		}
+		else if (strcmp(argv[i], FLAG_MAX_CONNECTIONS) == 0)
+		{
+			option_max_connections = atoi(argv[i + 1]);
+			if (option_max_connections <= 0)
+			{
+				option_max_connections = MAX_CONNECTIONS;
+			}
+			printf(YELLOW "Max connections set: " RESET "%d\n", option_max_connections);
+		}
+		else if (strcmp(argv[i], FLAG_SCHEDULER) == 0)
+		{
+			/* "shared" queue or per-worker "stealing" deques */
+			option_scheduler = strcmp(argv[i + 1], "stealing") == 0 ? threadpool_work_stealing : 0;
+			printf(YELLOW "Scheduler set: " RESET "%s\n", option_scheduler ? "stealing" : "shared");
+		}
+		else if (strcmp(argv[i], FLAG_REACTORS) == 0)
+		{
+			option_reactors = atoi(argv[i + 1]);
+			if (option_reactors <= 0)
+			{
+				option_reactors = cpu_count();
+			}
+			if (option_reactors > MAX_REACTORS)
+			{
+				option_reactors = MAX_REACTORS;
+			}
+			printf(YELLOW "Reactors set: " RESET "%d\n", option_reactors);
+		}
+		else if (strcmp(argv[i], FLAG_STEER) == 0)
+		{
+			/* "cpu" keeps a connection on the core that received it, "hash" is the kernel default */
+			option_steer = strcmp(argv[i + 1], "cpu") == 0;
+			printf(YELLOW "Steering set: " RESET "%s\n", option_steer ? "cpu" : "hash");
+		}
+		else if (strcmp(argv[i], FLAG_THREADS) == 0)
+		{
+			option_threads = atoi(argv[i + 1]);
+			if (option_threads < 0 || option_threads > MAX_THREADS)
+			{
+				option_threads = THREADS;
+			}
+			printf(YELLOW "Threads set: " RESET "%d\n", option_threads);
+		}
+		else if (strcmp(argv[i], FLAG_AFFINITY) == 0)
+		{
+			/* "pinned" binds worker i to the i-th usable cpu, "none" leaves it to the scheduler */
+			option_affinity = strcmp(argv[i + 1], "pinned") == 0 ? threadpool_pin_workers : 0;
+			printf(YELLOW "Affinity set: " RESET "%s\n", option_affinity ? "pinned" : "none");
+		}
+		else if (strcmp(argv[i], FLAG_THREAD_STACK) == 0)
+		{
+			option_thread_stack = atoi(argv[i + 1]);
+			if (option_thread_stack < 0)
+			{
+				option_thread_stack = THREAD_STACK;
+			}
+			/* Smaller stacks overflow on the first request */
+			if (option_thread_stack > 0 && option_thread_stack < MIN_THREAD_STACK)
+			{
+				option_thread_stack = MIN_THREAD_STACK;
+			}
+			printf(YELLOW "Thread stack set: " RESET "%dKiB\n", option_thread_stack);
+		}
+		else if (strcmp(argv[i], FLAG_MIN_THREADS) == 0)
+		{
+			option_min_threads = atoi(argv[i + 1]);
+			if (option_min_threads <= 0)
+			{
+				option_min_threads = MIN_THREADS;
+			}
+			printf(YELLOW "Min threads set: " RESET "%d\n", option_min_threads);
+		}
+		else if (strcmp(argv[i], FLAG_THREAD_IDLE) == 0)
+		{
+			option_thread_idle = atoi(argv[i + 1]);
+			printf(YELLOW "Thread idle set: " RESET "%dms\n", option_thread_idle);
+		}
+		else if (strcmp(argv[i], FLAG_CODEL_TARGET) == 0)
+		{
+			option_codel_target = atoi(argv[i + 1]);
+			printf(YELLOW "CoDel target set: " RESET "%dms\n", option_codel_target);
+		}
+		else if (strcmp(argv[i], FLAG_CODEL_INTERVAL) == 0)
+		{
+			option_codel_interval = atoi(argv[i + 1]);
+			printf(YELLOW "CoDel interval set: " RESET "%dms\n", option_codel_interval);
+		}
 	}
 	setbuf(stdout, NULL);
 
-	threadpool_t *thread_pool = threadpool_create(MAX_THREADS, SIZE, 0);
-	printf(GREEN "Thread pool created: %d threads\n" RESET, MAX_THREADS);
-
-	int server_fd = server_listen();
-	for (;;)
+	if (response_headers_init(SERVER_NAME) != 0)
 	{
-		void *thread_args_ptr = malloc(sizeof(struct ThreadArgs));
-		struct ThreadArgs *thread_args = (struct ThreadArgs *)(thread_args_ptr);
+		printf(RED "Response header setup failed...\n" RESET);
+		return C_ERR;
+	}
+	if (encoding_init(option_gzip_level) != 0)
+	{
+		printf(RED "Encoder setup failed...\n" RESET);
+		return C_ERR;
+	}
+	/* Sized from the affinity mask and cgroup quota, not the host's core count */
+	int threads = option_threads;
+	if (threads == 0)
+	{
+		threads = cpu_count();
+		threads = threads < MIN_THREADS ? MIN_THREADS : threads > MAX_THREADS ? MAX_THREADS : threads;
+	}
+	/* Elastic between the two, a minimum at or above the maximum makes it fixed */
+	threadpool_options_t pool_options = {
+		.flags = option_scheduler | option_affinity,
+		.stack_size = (size_t)option_thread_stack * 1024,
+		.min_threads = option_min_threads,
+		.idle_timeout = option_thread_idle,
+		.codel_target = option_codel_target,
+		.codel_interval = option_codel_interval,
+		.shed = server_shed,
+	};
+	thread_pool = threadpool_create_with(threads, SIZE, &pool_options);
+	if (thread_pool == NULL)
+	{
+		printf(RED "Thread pool creation failed...\n" RESET);
+		return C_ERR;
+	}
+	threadpool_stats_t pool_stats;
+	threadpool_stats(thread_pool, &pool_stats);
+	printf(GREEN "Thread pool created: %d-%d threads, %d cpus%s\n" RESET, pool_stats.threads, threads, cpu_count(), option_affinity ? ", pinned" : "");
 
-		socklen_t client_addr_len = sizeof(thread_args->client_addr);
-		thread_args->client_fd = accept(server_fd, (struct sockaddr *)&thread_args->client_addr, &client_addr_len);
-		if (thread_args->client_fd == -1)
+	signal(SIGPIPE, SIG_IGN);
+
+	router = router_create();
+	if (router == NULL || routes_register(router) != C_OK)
+	{
+		printf(RED "Route registration failed...\n" RESET);
+		return C_ERR;
+	}
+	if (option_file_cache > 0)
+	{
+		file_cache = file_cache_create((size_t)option_file_cache * 1024 * 1024, FILE_CACHE_MAX_ENTRY);
+		if (file_cache == NULL)
 		{
-			printf(RED "Client connection failed: %s \n" RESET, strerror(errno));
+			printf(RED "File cache creation failed...\n" RESET);
 		}
-		printf(CYAN "Client connected: %s:%d <----------\n" RESET, inet_ntoa(thread_args->client_addr.sin_addr), ntohs(thread_args->client_addr.sin_port));
+	}
+
+	if (connection_pool_init(option_max_connections) != 0)
+	{
+		printf(RED "Connection pool creation failed...\n" RESET);
+		return C_ERR;
+	}
+	printf(GREEN "Connection pool created: %d connections, %zu KiB\n" RESET, option_max_connections, connection_pool_bytes() / 1024);
 
-		if (threadpool_add(thread_pool, server_process_client, (void *)thread_args, 0) != 0)
+	int status = C_OK;
+#ifdef linux
+	/* Requests are answered by the reactors, the pool only compresses in the background */
+	if (option_reactors > 1)
+	{
+		status = server_run_reactors(option_reactors);
+	}
+	else
+#endif
+	{
+		int server_fd = server_listen(0);
+		/* C_ERR is 1, handed on it would put stdout in the event loop */
+		if (server_fd == C_ERR)
+		{
+			return C_ERR;
+		}
+		reactor_t *reactor = reactor_create(server_fd, thread_pool, request_frame, server_process_client, option_keep_alive_timeout);
+		if (reactor == NULL)
 		{
-			printf(RED "Failed to create thread: %s\n" RESET, strerror(errno));
-			free(thread_args);
-			free(thread_args_ptr);
+			return C_ERR;
 		}
+		reactor_run(reactor);
+		reactor_destroy(reactor);
+		printf(RED "Closing server socket...\n" RESET);
+#ifdef linux
+		close(server_fd);
+#elif _WIN32
+		closesocket(server_fd);
+#endif
 	}
+	router_destroy(router);
 
+	threadpool_stats(thread_pool, &pool_stats);
+	printf(YELLOW "Thread pool: %d threads (peak %d), %llu spawned, %llu retired, %llu spawn failures\n" RESET,
+		   pool_stats.threads, pool_stats.peak, pool_stats.spawned, pool_stats.retired, pool_stats.spawn_failures);
+	printf(YELLOW "Admission: %llu shed, %llu served newest first\n" RESET, pool_stats.shed, pool_stats.lifo);
 	printf(YELLOW "Killing threadpool...\n" RESET);
 	threadpool_destroy(thread_pool, 0);
-	printf(RED "Closing server socket...\n" RESET);
-#ifdef linux
-	close(server_fd);
-#elif _WIN32
-	closesocket(server_fd);
-#endif
-	return C_OK;
+	arena_stats_t stats;
+	arena_stats(&stats);
+	printf(YELLOW "Arena: %llu resets, %llu allocations, %llu heap allocations (%llu bytes)\n" RESET,
+		   stats.resets, stats.allocations, stats.heap_allocations, stats.heap_bytes);
+	/* After the pool, background compression may still hold entries */
+	file_cache_destroy(file_cache);
+	connection_pool_destroy();
+	encoding_destroy();
+	response_headers_destroy();
+	return status;
 }
@@ -0,0 +1,147 @@
+/**
+ * @file slab.c
+ * @brief Fixed-size objects carved from one preallocated block
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define SLAB_NIL UINT32_MAX // empty free stack
+
+/**
+ *  @struct slab_t
+ *  @brief A block of equal objects and the stack of free ones
+ *
+ *  @var objects      capacity objects, stride bytes apart.
+ *  @var head         Tag in the high half, top free index in the low half.
+ *  @var next         Free stack links, by index.
+ *  @var generations  Per-object counters, odd while allocated.
+ */
+struct slab_t
+{
+    char *objects;
+    size_t stride;
+    uint32_t capacity;
+    uint64_t head __attribute__((aligned(SLAB_CACHE_LINE)));
+    size_t in_use __attribute__((aligned(SLAB_CACHE_LINE)));
+    uint32_t *next;
+    unsigned *generations;
+};
+
+slab_t *slab_create(size_t object_size, size_t capacity)
+{
+    if (object_size == 0 || capacity == 0 || capacity >= SLAB_NIL)
+    {
+        return NULL;
+    }
+    slab_t *slab = (slab_t *)aligned_alloc(SLAB_CACHE_LINE, sizeof(slab_t));
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+    slab->stride = (object_size + SLAB_CACHE_LINE - 1) & ~(size_t)(SLAB_CACHE_LINE - 1);
+    slab->capacity = (uint32_t)capacity;
+    slab->objects = (char *)aligned_alloc(SLAB_CACHE_LINE, slab->stride * capacity);
+    slab->next = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    slab->generations = (unsigned *)calloc(capacity, sizeof(unsigned));
+    if (slab->objects == NULL || slab->next == NULL || slab->generations == NULL)
+    {
+        slab_destroy(slab);
+        return NULL;
+    }
+
+    /* Lowest addresses first, so a lightly loaded server touches few pages */
+    for (uint32_t i = 0; i < slab->capacity; i++)
+    {
+        slab->next[i] = i + 1 < slab->capacity ? i + 1 : SLAB_NIL;
+    }
+    slab->head = 0;
+    slab->in_use = 0;
+    return slab;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+    uint64_t head = __atomic_load_n(&slab->head, __ATOMIC_ACQUIRE);
+    uint32_t index;
+    for (;;)
+    {
+        index = (uint32_t)head;
+        if (index == SLAB_NIL)
+        {
+            return NULL;
+        }
+        /* May read a link that is being rewritten, the tag then fails the swap */
+        uint32_t next = __atomic_load_n(&slab->next[index], __ATOMIC_RELAXED);
+        uint64_t update = (((head >> 32) + 1) << 32) | next;
+        if (__atomic_compare_exchange_n(&slab->head, &head, update, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+    }
+    __atomic_fetch_add(&slab->generations[index], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slab->in_use, 1, __ATOMIC_RELAXED);
+    return slab->objects + (size_t)index * slab->stride;
+}
+
+int slab_free(slab_t *slab, void *object)
+{
+    char *p = (char *)object;
+    if (p < slab->objects || p >= slab->objects + slab->stride * slab->capacity ||
+        (size_t)(p - slab->objects) % slab->stride != 0)
+    {
+        return -1;
+    }
+    uint32_t index = (uint32_t)((size_t)(p - slab->objects) / slab->stride);
+
+    /* Odd to even exactly once, a second free finds it even */
+    unsigned generation = __atomic_load_n(&slab->generations[index], __ATOMIC_RELAXED);
+    do
+    {
+        if ((generation & 1) == 0)
+        {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&slab->generations[index], &generation, generation + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_fetch_sub(&slab->in_use, 1, __ATOMIC_RELAXED);
+
+    uint64_t head = __atomic_load_n(&slab->head, __ATOMIC_RELAXED);
+    uint64_t update;
+    do
+    {
+        __atomic_store_n(&slab->next[index], (uint32_t)head, __ATOMIC_RELAXED);
+        update = (((head >> 32) + 1) << 32) | index;
+    } while (!__atomic_compare_exchange_n(&slab->head, &head, update, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 0;
+}
+
+unsigned slab_generation(const slab_t *slab, const void *object)
+{
+    size_t index = (size_t)((const char *)object - slab->objects) / slab->stride;
+    return __atomic_load_n(&slab->generations[index], __ATOMIC_ACQUIRE);
+}
+
+size_t slab_in_use(const slab_t *slab)
+{
+    return __atomic_load_n(&slab->in_use, __ATOMIC_RELAXED);
+}
+
+size_t slab_bytes(const slab_t *slab)
+{
+    return slab->stride * slab->capacity;
+}
+
+void slab_destroy(slab_t *slab)
+{
+    if (slab == NULL)
+    {
+        return;
+    }
+    free(slab->objects);
+    free(slab->next);
+    free(slab->generations);
+    free(slab);
+}
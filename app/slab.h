@@ -0,0 +1,78 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file slab.h
+     * @brief Fixed-size objects carved from one preallocated block
+     *
+     * Every object starts on its own cache line so neighbours owned by
+     * different threads do not false-share. Free objects sit on a
+     * lock-free stack whose head carries a tag bumped on every change,
+     * which keeps a stale compare-and-swap from succeeding after the same
+     * object was popped and pushed again (ABA). Each object also has a
+     * generation counter, odd while allocated, so a double free is caught
+     * instead of corrupting the stack.
+     */
+
+#define SLAB_CACHE_LINE 64
+
+    typedef struct slab_t slab_t;
+
+    /**
+     * @function slab_create
+     * @brief Preallocates capacity objects of object_size bytes.
+     * @return the slab, or NULL on allocation failure
+     */
+    slab_t *slab_create(size_t object_size, size_t capacity);
+
+    /**
+     * @function slab_alloc
+     * @brief Takes a free object. Safe to call from any thread.
+     * @return the object, uninitialised, or NULL when all are in use
+     */
+    void *slab_alloc(slab_t *slab);
+
+    /**
+     * @function slab_free
+     * @brief Returns an object. Safe to call from any thread.
+     * @return 0 on success, -1 if object is not allocated from slab
+     */
+    int slab_free(slab_t *slab, void *object);
+
+    /**
+     * @function slab_generation
+     * @brief Times object has been allocated or freed. Lets a holder of
+     *        a saved generation tell whether the object was recycled.
+     */
+    unsigned slab_generation(const slab_t *slab, const void *object);
+
+    /**
+     * @function slab_in_use
+     * @brief Objects currently allocated.
+     */
+    size_t slab_in_use(const slab_t *slab);
+
+    /**
+     * @function slab_bytes
+     * @brief Memory reserved for objects, the slab's whole footprint.
+     */
+    size_t slab_bytes(const slab_t *slab);
+
+    /**
+     * @function slab_destroy
+     * @brief Frees the block. Objects still in use become invalid.
+     */
+    void slab_destroy(slab_t *slab);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SLAB_H_ */
@@ -1,16 +1,60 @@
 /**
  * @file threadpool.c
  * @brief Threadpool implementation file
+ *
+ * Tasks go through a bounded multi-producer multi-consumer ring in the
+ * style of Dmitry Vyukov: every cell carries a sequence number telling
+ * producers and consumers whose turn it is, so neither side takes a lock
+ * and each only contends on its own index. Idle workers park on an event
+ * count, a futex on Linux, which producers only touch when someone is
+ * actually asleep.
+ *
+ * With threadpool_work_stealing every worker owns a Chase-Lev deque
+ * instead: the owner pushes and pops at the bottom without contention and
+ * idle workers steal from the top. Other threads may not touch the
+ * bottom, so their tasks are dealt round-robin into a small ring of the
+ * above kind that each worker keeps as an inbox.
+ *
+ * Workers allocate their own deque and inbox once running, after pinning
+ * if asked to, and wait for each other before taking tasks so no thief
+ * looks at a queue that is not there yet.
+ *
+ * An elastic pool grows from threadpool_add(), or from a worker that
+ * finds a backlog, by starting one more worker when nobody is idle and
+ * the shared queue is deep or slow.
+ * Workers park with a timeout and a spare one whose nap runs out exits.
+ * Its slot is joined and reused by the next worker started.
+ *
+ * Admission control follows the CoDel variant used for server request
+ * queues rather than packet queues: the shortest sojourn seen during an
+ * interval tells a standing queue from a burst, and while one stands the
+ * requests that waited longest are refused, since their clients have
+ * likely given up. New requests meanwhile go on a small LIFO stack that
+ * workers empty first, so the ones still worth answering are answered
+ * quickly. The stack takes a lock, but only while overloaded.
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #ifdef __linux__
 #include <pthread.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #endif
 
 #include "threadpool.h"
+#include "cpu.h"
+
+#define CACHE_LINE 64
+#define THREADPOOL_MIN_LOCAL 64 // smallest per-worker deque and inbox
+#define THREADPOOL_LIFO_SIZE 256 // newest tasks served first when overloaded, the rest queue behind
 
 typedef enum
 {
@@ -18,32 +62,139 @@ typedef enum
     graceful_shutdown = 2
 } threadpool_shutdown_t;
 
+typedef enum
+{
+    worker_vacant = 0, // no thread
+    worker_running = 1,
+    worker_exited = 2 // retired, waiting to be joined
+} threadpool_worker_state_t;
+
 /**
  *  @struct threadpool_task
  *  @brief the work struct
  *
  *  @var function Pointer to the function that will perform the task.
  *  @var argument Argument to be passed to the function.
+ *  @var enqueued Monotonic nanoseconds when queued, 0 if not measured.
+ *  @var flags    threadpool_add_flags_t values.
  */
 
 typedef struct
 {
     void (*function)(void *);
     void *argument;
+    long long enqueued;
+    int flags;
 } threadpool_task_t;
 
+/**
+ *  @struct threadpool_cell_t
+ *  @brief A ring slot
+ *
+ *  @var sequence Equals the enqueue position when the slot is free for
+ *                it, that position + 1 once the task is ready to dequeue.
+ */
+typedef struct
+{
+    size_t sequence;
+    threadpool_task_t task;
+} threadpool_cell_t;
+
+/**
+ *  @struct threadpool_ring_t
+ *  @brief Bounded MPMC queue
+ *
+ *  @var cells  mask + 1 slots, a power of two.
+ *  @var head   Next position to dequeue, owned by consumers.
+ *  @var tail   Next position to enqueue, owned by producers.
+ */
+typedef struct
+{
+    threadpool_cell_t *cells;
+    size_t mask;
+    size_t head __attribute__((aligned(CACHE_LINE)));
+    size_t tail __attribute__((aligned(CACHE_LINE)));
+} threadpool_ring_t;
+
+/**
+ *  @struct threadpool_deque_t
+ *  @brief Chase-Lev deque of fixed size
+ *
+ *  @var tasks   mask + 1 slots, a power of two.
+ *  @var top     Next task to steal, advanced by thieves and by the owner
+ *               taking the last task.
+ *  @var bottom  Next free slot, written by the owner only.
+ */
+typedef struct
+{
+    threadpool_task_t *tasks;
+    long mask;
+    long top __attribute__((aligned(CACHE_LINE)));
+    long bottom __attribute__((aligned(CACHE_LINE)));
+} threadpool_deque_t;
+
+/**
+ *  @struct threadpool_worker_t
+ *  @brief Per-thread scheduler state
+ *
+ *  @var seed   Picks steal victims.
+ *  @var cpu    Processor the worker is pinned to, -1 for none.
+ *  @var state  threadpool_worker_state_t of the slot.
+ *  @var deque  Tasks the worker added itself, work stealing only.
+ *  @var inbox  Tasks dealt to the worker by other threads, work stealing
+ *              only.
+ */
+typedef struct
+{
+    struct threadpool_t *pool;
+    unsigned seed;
+    int cpu;
+    int state;
+    threadpool_deque_t deque;
+    threadpool_ring_t inbox;
+} threadpool_worker_t;
+
 /**
  *  @struct threadpool
  *  @brief The threadpool struct
  *
+ *  @var lock         Parks workers where there is no futex.
  *  @var notify       Condition variable to notify worker threads.
+ *  @var resize       Serialises starting and retiring workers.
  *  @var threads      Array containing worker threads ID.
- *  @var thread_count Number of threads
- *  @var queue        Array containing the task queue.
- *  @var queue_size   Size of the task queue.
- *  @var head         Index of the first element.
- *  @var tail         Index of the next element.
- *  @var count        Number of pending tasks
+ *  @var workers      Scheduler state of each thread.
+ *  @var worker_count Entries in workers, the most threads the pool runs.
+ *  @var thread_count Workers running now.
+ *  @var min_threads  Workers an elastic pool keeps, worker_count if fixed.
+ *  @var idle_timeout Milliseconds a spare worker naps before exiting.
+ *  @var spawn_wait   Queue wait in nanoseconds that makes the pool grow.
+ *  @var spawn_depth  Queue depth that makes the pool grow.
+ *  @var queue_wait   Nanoseconds the latest task taken had waited.
+ *  @var stats        Scaling counters, threads and queue_wait unused.
+ *  @var shed         Admission control refuses tasks through this.
+ *  @var codel_target Standing queue delay in nanoseconds.
+ *  @var codel_interval Nanoseconds per minimum delay sample.
+ *  @var interval_end When the current interval ends.
+ *  @var min_delay    Shortest sojourn of the current interval.
+ *  @var overloaded   The previous interval stayed above target.
+ *  @var lifo_lock    Protects lifo.
+ *  @var lifo         Admission tasks queued newest first while overloaded.
+ *  @var lifo_count   Tasks on lifo.
+ *  @var lifo_capacity Slots in lifo.
+ *  @var timed        Tasks are stamped when queued.
+ *  @var elastic      Workers are started and retired on demand.
+ *  @var spawning     A started worker has not reached its loop yet.
+ *  @var stealing     Created with threadpool_work_stealing.
+ *  @var local        Capacity of each worker's deque and inbox.
+ *  @var stack_size   Worker stack bytes, 0 for the default.
+ *  @var ready        Workers done setting up, or that failed to.
+ *  @var failed       A worker could not allocate its queues.
+ *  @var queue        Shared task queue, unless stealing.
+ *  @var next         Worker whose inbox gets the next outside task.
+ *  @var epoch        Event count, bumped to wake parked workers.
+ *  @var sleepers     Workers parked or about to park.
+ *  @var waking       A wake is in flight and has not been picked up yet.
+ *  @var parked       Workers blocked on notify, without futexes only.
  *  @var shutdown     Flag indicating if the pool is shutting down
  *  @var started      Number of started threads
  */
@@ -51,71 +202,659 @@ struct threadpool_t
 {
     mtx_t lock;
     cnd_t notify;
+    mtx_t resize;
     thrd_t *threads;
-    threadpool_task_t *queue;
+    threadpool_worker_t *workers;
+    int worker_count;
     int thread_count;
-    int queue_size;
-    int head;
-    int tail;
-    int count;
-    int shutdown;
+    int min_threads;
+    int idle_timeout;
+    long long spawn_wait;
+    size_t spawn_depth;
+    long long queue_wait;
+    threadpool_stats_t stats;
+    void (*shed)(void *);
+    long long codel_target;
+    long long codel_interval;
+    long long interval_end __attribute__((aligned(CACHE_LINE)));
+    long long min_delay;
+    int overloaded;
+    mtx_t lifo_lock __attribute__((aligned(CACHE_LINE)));
+    threadpool_task_t *lifo;
+    size_t lifo_count;
+    size_t lifo_capacity;
+    int timed;
+    int elastic;
+    int spawning;
+    int stealing;
+    size_t local;
+    size_t stack_size;
+    int ready;
+    int failed;
+    threadpool_ring_t queue;
+    unsigned next __attribute__((aligned(CACHE_LINE)));
+    unsigned epoch __attribute__((aligned(CACHE_LINE)));
+    int sleepers;
+    int waking;
+    int parked;
+    int shutdown __attribute__((aligned(CACHE_LINE)));
     int started;
 };
 
+/* The worker running on this thread, NULL outside any pool */
+static _Thread_local threadpool_worker_t *current_worker;
+
 /**
- * @function void *threadpool_thread(void *threadpool)
+ * @function int threadpool_thread(void *worker)
  * @brief the worker thread
- * @param threadpool the pool which own the thread
+ * @param worker the worker state, which points to the pool
  */
-static void *threadpool_thread(void *threadpool);
+static int threadpool_thread(void *worker);
 
 int threadpool_free(threadpool_t *pool);
 
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parks the caller while epoch still reads seen, for at most timeout
+   milliseconds unless 0, returns 1 if the time ran out */
+static int threadpool_park(threadpool_t *pool, unsigned seen, int timeout)
+{
+#ifdef __linux__
+    struct timespec ts = {timeout / 1000, (long)(timeout % 1000) * 1000000};
+    long result = syscall(SYS_futex, &pool->epoch, FUTEX_WAIT_PRIVATE, seen, timeout > 0 ? &ts : NULL, NULL, 0);
+    return result == -1 && errno == ETIMEDOUT;
+#else
+    struct timespec deadline;
+    int timed_out = 0;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_sec += timeout / 1000 + (deadline.tv_nsec + (long)(timeout % 1000) * 1000000) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + (long)(timeout % 1000) * 1000000) % 1000000000;
+    mtx_lock(&(pool->lock));
+    pool->parked++;
+    while (!timed_out && __atomic_load_n(&pool->epoch, __ATOMIC_ACQUIRE) == seen)
+    {
+        if (timeout > 0)
+        {
+            timed_out = cnd_timedwait(&(pool->notify), &(pool->lock), &deadline) == thrd_timedout;
+        }
+        else
+        {
+            cnd_wait(&(pool->notify), &(pool->lock));
+        }
+    }
+    pool->parked--;
+    mtx_unlock(&(pool->lock));
+    return timed_out;
+#endif
+}
+
+/* Bumps the epoch and wakes up to count parked workers, returns how many were parked */
+static int threadpool_unpark(threadpool_t *pool, int count)
+{
+#ifdef __linux__
+    __atomic_fetch_add(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+    long woken = syscall(SYS_futex, &pool->epoch, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    return woken > 0 ? (int)woken : 0;
+#else
+    mtx_lock(&(pool->lock));
+    __atomic_fetch_add(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+    int woken = pool->parked < count ? pool->parked : count;
+    if (count == 1)
+    {
+        cnd_signal(&(pool->notify));
+    }
+    else
+    {
+        cnd_broadcast(&(pool->notify));
+    }
+    mtx_unlock(&(pool->lock));
+    return woken;
+#endif
+}
+
+/* Wakes one sleeper unless another wake is still on its way, a burst of
+   tasks then costs one futex call and the woken worker passes it on */
+static void threadpool_wake(threadpool_t *pool)
+{
+    int idle = 0;
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) == 0 ||
+        !__atomic_compare_exchange_n(&pool->waking, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (threadpool_unpark(pool, 1) == 0)
+    {
+        /* Everyone counted was still on the way down and will recheck the queue */
+        __atomic_store_n(&pool->waking, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static size_t power_of_two(size_t size)
+{
+    size_t capacity = 1;
+    while (capacity < size)
+    {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+static int ring_init(threadpool_ring_t *ring, size_t capacity)
+{
+    ring->cells = (threadpool_cell_t *)malloc(sizeof(threadpool_cell_t) * capacity);
+    if (ring->cells == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        ring->cells[i].sequence = i;
+    }
+    ring->mask = capacity - 1;
+    ring->head = ring->tail = 0;
+    return 0;
+}
+
+static int ring_push(threadpool_ring_t *ring, const threadpool_task_t *task)
+{
+    size_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    threadpool_cell_t *cell;
+
+    for (;;)
+    {
+        cell = &ring->cells[position & ring->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+        if (difference == 0)
+        {
+            /* The slot is free for this position, claim it */
+            if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            /* A whole lap ahead of the consumers */
+            return -1;
+        }
+        else
+        {
+            position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->task = *task;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ring_pop(threadpool_ring_t *ring, threadpool_task_t *task)
+{
+    size_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    threadpool_cell_t *cell;
+
+    for (;;)
+    {
+        cell = &ring->cells[position & ring->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->head, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            /* Empty */
+            return -1;
+        }
+        else
+        {
+            position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    *task = cell->task;
+    /* Free for the producer one lap later */
+    __atomic_store_n(&cell->sequence, position + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ring_empty(threadpool_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+static int deque_init(threadpool_deque_t *deque, size_t capacity)
+{
+    deque->tasks = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * capacity);
+    if (deque->tasks == NULL)
+    {
+        return -1;
+    }
+    deque->mask = (long)capacity - 1;
+    deque->top = deque->bottom = 0;
+    return 0;
+}
+
+/* Slots are read by thieves while the owner may write the next lap, hence the atomics */
+static void deque_read(threadpool_task_t *slot, threadpool_task_t *task)
+{
+    task->function = __atomic_load_n(&slot->function, __ATOMIC_RELAXED);
+    task->argument = __atomic_load_n(&slot->argument, __ATOMIC_RELAXED);
+    task->enqueued = 0;
+    task->flags = 0;
+}
+
+/* Owner only */
+static int deque_push(threadpool_deque_t *deque, void (*function)(void *), void *argument)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top > deque->mask)
+    {
+        return -1;
+    }
+    threadpool_task_t *slot = &deque->tasks[bottom & deque->mask];
+    __atomic_store_n(&slot->function, function, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->argument, argument, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Owner only, newest first so the task still finds its data in cache */
+static int deque_pop(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    deque_read(&deque->tasks[bottom & deque->mask], task);
+    if (top == bottom)
+    {
+        /* The last task, a thief may be after it too */
+        int won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                              __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Any thread, oldest first */
+static int deque_steal(threadpool_deque_t *deque, threadpool_task_t *task)
+{
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom)
+    {
+        return -1;
+    }
+    deque_read(&deque->tasks[top & deque->mask], task);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        /* Lost to the owner or another thief */
+        return -1;
+    }
+    return 0;
+}
+
+static int deque_empty(threadpool_deque_t *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_RELAXED) >= __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+}
+
+static int lifo_push(threadpool_t *pool, const threadpool_task_t *task)
+{
+    int pushed = -1;
+    mtx_lock(&(pool->lifo_lock));
+    if (pool->lifo_count < pool->lifo_capacity)
+    {
+        pool->lifo[pool->lifo_count] = *task;
+        __atomic_store_n(&pool->lifo_count, pool->lifo_count + 1, __ATOMIC_RELAXED);
+        pushed = 0;
+    }
+    mtx_unlock(&(pool->lifo_lock));
+    return pushed;
+}
+
+static int lifo_pop(threadpool_t *pool, threadpool_task_t *task)
+{
+    int popped = -1;
+    if (__atomic_load_n(&pool->lifo_count, __ATOMIC_RELAXED) == 0)
+    {
+        return -1;
+    }
+    mtx_lock(&(pool->lifo_lock));
+    if (pool->lifo_count > 0)
+    {
+        __atomic_store_n(&pool->lifo_count, pool->lifo_count - 1, __ATOMIC_RELAXED);
+        *task = pool->lifo[pool->lifo_count];
+        popped = 0;
+    }
+    mtx_unlock(&(pool->lifo_lock));
+    return popped;
+}
+
+/* Shared queue, lifo and ring, holds nothing */
+static int queue_empty(threadpool_t *pool)
+{
+    return ring_empty(&pool->queue) && __atomic_load_n(&pool->lifo_count, __ATOMIC_RELAXED) == 0;
+}
+
+/* Own deque, own inbox, then everyone else's starting from a random victim */
+static int threadpool_take(threadpool_worker_t *worker, threadpool_task_t *task)
+{
+    threadpool_t *pool = worker->pool;
+    if (!pool->stealing)
+    {
+        /* While overloaded the newest requests go first */
+        if (pool->lifo != NULL && lifo_pop(pool, task) == 0)
+        {
+            return 0;
+        }
+        return ring_pop(&pool->queue, task);
+    }
+    if (deque_pop(&worker->deque, task) == 0 || ring_pop(&worker->inbox, task) == 0)
+    {
+        return 0;
+    }
+
+    /* xorshift32 */
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    int start = (int)(worker->seed % (unsigned)pool->worker_count);
+    for (int i = 0; i < pool->worker_count; i++)
+    {
+        threadpool_worker_t *victim = &pool->workers[(start + i) % pool->worker_count];
+        if (victim != worker && (deque_steal(&victim->deque, task) == 0 || ring_pop(&victim->inbox, task) == 0))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Whether the worker can see more work after the task it just took */
+static int threadpool_backlog(threadpool_worker_t *worker)
+{
+    threadpool_t *pool = worker->pool;
+    if (!pool->stealing)
+    {
+        return !queue_empty(pool);
+    }
+    return !deque_empty(&worker->deque) || !ring_empty(&worker->inbox);
+}
+
+/* thrd_create() takes no attributes, a custom stack size needs pthreads */
+#ifdef __linux__
+static void *threadpool_start(void *worker)
+{
+    return (void *)(intptr_t)threadpool_thread(worker);
+}
+#endif
+
+static int threadpool_spawn(threadpool_t *pool, int i)
+{
+#ifdef __linux__
+    if (pool->stack_size > 0)
+    {
+        pthread_attr_t attr;
+        size_t stack_size = pool->stack_size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : pool->stack_size;
+        if (pthread_attr_init(&attr) != 0)
+        {
+            return thrd_error;
+        }
+        int error = pthread_attr_setstacksize(&attr, stack_size);
+        if (error == 0)
+        {
+            error = pthread_create(&pool->threads[i], &attr, threadpool_start, (void *)&pool->workers[i]);
+        }
+        pthread_attr_destroy(&attr);
+        return error == 0 ? thrd_success : thrd_error;
+    }
+#endif
+    return thrd_create(&(pool->threads[i]), threadpool_thread, (void *)&pool->workers[i]);
+}
+
+/* Runs a new thread in slot i with resize held, reaping the one that left it */
+static int threadpool_start_worker(threadpool_t *pool, int i)
+{
+    threadpool_worker_t *worker = &pool->workers[i];
+    if (worker->state == worker_exited)
+    {
+        thrd_join(pool->threads[i], NULL);
+    }
+    __atomic_store_n(&worker->state, worker_running, __ATOMIC_RELAXED);
+    int running = __atomic_add_fetch(&pool->thread_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool->started, 1, __ATOMIC_RELAXED);
+    if (threadpool_spawn(pool, i) != thrd_success)
+    {
+        __atomic_store_n(&worker->state, worker_vacant, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&pool->thread_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&pool->started, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (running > pool->stats.peak)
+    {
+        pool->stats.peak = running;
+    }
+    return 0;
+}
+
+/* One more worker when nobody is idle and tasks pile up or wait too long */
+static void threadpool_grow(threadpool_t *pool)
+{
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) > 0 ||
+        __atomic_load_n(&pool->spawning, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED) >= pool->worker_count)
+    {
+        return;
+    }
+    size_t depth = __atomic_load_n(&pool->queue.tail, __ATOMIC_RELAXED) - __atomic_load_n(&pool->queue.head, __ATOMIC_RELAXED) +
+                   __atomic_load_n(&pool->lifo_count, __ATOMIC_RELAXED);
+    if (depth < pool->spawn_depth && __atomic_load_n(&pool->queue_wait, __ATOMIC_RELAXED) < pool->spawn_wait)
+    {
+        return;
+    }
+
+    /* Someone else is already on it */
+    if (mtx_trylock(&(pool->resize)) != thrd_success)
+    {
+        return;
+    }
+    if (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE) &&
+        pool->thread_count < pool->worker_count && !__atomic_load_n(&pool->spawning, __ATOMIC_RELAXED))
+    {
+        for (int i = 0; i < pool->worker_count; i++)
+        {
+            if (pool->workers[i].state == worker_running)
+            {
+                continue;
+            }
+            __atomic_store_n(&pool->spawning, 1, __ATOMIC_RELAXED);
+            if (threadpool_start_worker(pool, i) == 0)
+            {
+                __atomic_fetch_add(&pool->stats.spawned, 1, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                __atomic_store_n(&pool->spawning, 0, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&pool->stats.spawn_failures, 1, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+    }
+    mtx_unlock(&(pool->resize));
+}
+
+/* Called by a worker whose nap ran out, returns 1 if it should exit */
+static int threadpool_retire(threadpool_worker_t *worker)
+{
+    threadpool_t *pool = worker->pool;
+    int retire = 0;
+    mtx_lock(&(pool->resize));
+    if (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE) && pool->thread_count > pool->min_threads)
+    {
+        __atomic_fetch_sub(&pool->thread_count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker->state, worker_exited, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&pool->stats.retired, 1, __ATOMIC_RELAXED);
+        retire = 1;
+    }
+    mtx_unlock(&(pool->resize));
+    return retire;
+}
+
 threadpool_t *threadpool_create(int thread_count, int queue_size, int flags)
+{
+    threadpool_options_t options = {flags, 0, 0, 0, 0, 0, 0, 0, NULL};
+    return threadpool_create_with(thread_count, queue_size, &options);
+}
+
+threadpool_t *threadpool_create_with(int thread_count, int queue_size,
+                                     const threadpool_options_t *options)
 {
     threadpool_t *pool;
     int i;
-    (void)flags;
 
     if (thread_count <= 0 || thread_count > MAX_THREADS || queue_size <= 0 || queue_size > MAX_QUEUE)
     {
         return NULL;
     }
 
-    if ((pool = (threadpool_t *)malloc(sizeof(threadpool_t))) == NULL)
+    if ((pool = (threadpool_t *)aligned_alloc(CACHE_LINE, sizeof(threadpool_t))) == NULL)
     {
         goto err;
     }
 
     /* Initialize */
     pool->thread_count = 0;
-    pool->queue_size = queue_size;
-    pool->head = pool->tail = pool->count = 0;
+    pool->worker_count = 0;
+    pool->stealing = (options->flags & threadpool_work_stealing) != 0;
+    pool->stack_size = options->stack_size;
+    pool->ready = pool->failed = 0;
+    /* Stealing deals tasks to every inbox, all of them need a worker */
+    pool->min_threads = thread_count;
+    if (!pool->stealing && options->min_threads > 0 && options->min_threads < thread_count)
+    {
+        pool->min_threads = options->min_threads;
+    }
+    pool->elastic = pool->min_threads < thread_count;
+    pool->idle_timeout = options->idle_timeout > 0 ? options->idle_timeout : 0;
+    pool->spawn_wait = (long long)(options->spawn_wait > 0 ? options->spawn_wait : THREADPOOL_SPAWN_WAIT) * 1000;
+    pool->spawn_depth = (size_t)(options->spawn_depth > 0 ? options->spawn_depth : THREADPOOL_SPAWN_DEPTH);
+    pool->queue_wait = 0;
+    pool->spawning = 0;
+    pool->shed = options->codel_target > 0 ? options->shed : NULL;
+    pool->codel_target = (long long)options->codel_target * 1000000;
+    pool->codel_interval = (long long)(options->codel_interval > 0 ? options->codel_interval : THREADPOOL_CODEL_INTERVAL) * 1000000;
+    pool->interval_end = now_ns() + pool->codel_interval;
+    pool->min_delay = LLONG_MAX;
+    pool->overloaded = 0;
+    pool->lifo = NULL;
+    pool->lifo_count = pool->lifo_capacity = 0;
+    pool->timed = pool->elastic || pool->shed != NULL;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    pool->queue.cells = NULL;
+    pool->next = 0;
+    pool->epoch = 0;
+    pool->sleepers = pool->waking = pool->parked = 0;
     pool->shutdown = pool->started = 0;
 
     /* Allocate thread and task queue */
     pool->threads = (thrd_t *)malloc(sizeof(thrd_t) * thread_count);
-    pool->queue = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * queue_size);
+    pool->workers = (threadpool_worker_t *)aligned_alloc(CACHE_LINE, sizeof(threadpool_worker_t) * thread_count);
+    if (pool->workers != NULL)
+    {
+        memset(pool->workers, 0, sizeof(threadpool_worker_t) * thread_count);
+        pool->worker_count = thread_count;
+    }
 
     /* Initialize mutex and conditional variable first */
-    if ((mtx_init(&(pool->lock), NULL) != thrd_success) ||
+    if ((mtx_init(&(pool->lock), mtx_plain) != thrd_success) ||
         (cnd_init(&(pool->notify)) != thrd_success) ||
+        (mtx_init(&(pool->resize), mtx_plain) != thrd_success) ||
+        (mtx_init(&(pool->lifo_lock), mtx_plain) != thrd_success) ||
         (pool->threads == NULL) ||
-        (pool->queue == NULL))
+        (pool->workers == NULL))
+    {
+        goto err;
+    }
+
+    /* Sequence arithmetic wants powers of two, work stealing splits the queue between workers */
+    pool->local = power_of_two((size_t)(queue_size + thread_count - 1) / thread_count);
+    if (pool->local < THREADPOOL_MIN_LOCAL)
+    {
+        pool->local = THREADPOOL_MIN_LOCAL;
+    }
+    if (!pool->stealing && ring_init(&pool->queue, power_of_two((size_t)queue_size)) != 0)
     {
         goto err;
     }
+    if (!pool->stealing && pool->shed != NULL)
+    {
+        pool->lifo_capacity = THREADPOOL_LIFO_SIZE < queue_size ? THREADPOOL_LIFO_SIZE : (size_t)queue_size;
+        if ((pool->lifo = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * pool->lifo_capacity)) == NULL)
+        {
+            goto err;
+        }
+    }
 
-    /* Start worker threads */
+    int cpus[CPU_MAX];
+    int cpu_total = 0;
+    if (options->flags & threadpool_pin_workers)
+    {
+        cpu_total = cpu_list(cpus, CPU_MAX);
+    }
     for (i = 0; i < thread_count; i++)
     {
-        if (thrd_create(&(pool->threads[i]), threadpool_thread, (void *)pool) != thrd_success)
+        threadpool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->seed = 2654435761u * (unsigned)(i + 1);
+        worker->cpu = cpu_total > 0 ? cpus[i % cpu_total] : -1;
+    }
+
+    /* Start worker threads, an elastic pool adds the rest on demand */
+    mtx_lock(&(pool->resize));
+    for (i = 0; i < pool->min_threads; i++)
+    {
+        if (threadpool_start_worker(pool, i) != 0)
         {
+            mtx_unlock(&(pool->resize));
             threadpool_destroy(pool, 0);
             return NULL;
         }
-        pool->thread_count++;
-        pool->started++;
+    }
+    mtx_unlock(&(pool->resize));
+
+    /* Tasks may only be added once every queue exists */
+    while (__atomic_load_n(&pool->ready, __ATOMIC_ACQUIRE) < pool->min_threads)
+    {
+        thrd_yield();
+    }
+    if (__atomic_load_n(&pool->failed, __ATOMIC_RELAXED))
+    {
+        threadpool_destroy(pool, 0);
+        return NULL;
     }
 
     return pool;
@@ -131,58 +870,71 @@ err:
 int threadpool_add(threadpool_t *pool, void (*function)(void *),
                    void *argument, int flags)
 {
-    int err = 0;
-    int next;
-    (void)flags;
+    int queued = -1;
 
     if (pool == NULL || function == NULL)
     {
         return threadpool_invalid;
     }
 
-    if (mtx_lock(&(pool->lock)) != thrd_success)
+    /* Are we shutting down ? */
+    if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
     {
-        return threadpool_lock_failure;
+        return threadpool_shutdown;
     }
 
-    next = (pool->tail + 1) % pool->queue_size;
-
-    do
+    threadpool_task_t task = {function, argument, pool->timed ? now_ns() : 0, flags};
+    int admission = (flags & threadpool_admission) && pool->shed != NULL;
+    if (!pool->stealing)
     {
-        /* Are we full ? */
-        if (pool->count == pool->queue_size)
+        if (admission && pool->lifo != NULL && __atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED) &&
+            lifo_push(pool, &task) == 0)
         {
-            err = threadpool_queue_full;
-            break;
+            __atomic_fetch_add(&pool->stats.lifo, 1, __ATOMIC_RELAXED);
+            queued = 0;
         }
-
-        /* Are we shutting down ? */
-        if (pool->shutdown)
+        else
         {
-            err = threadpool_shutdown;
-            break;
+            queued = ring_push(&pool->queue, &task);
         }
-
-        /* Add task to queue */
-        pool->queue[pool->tail].function = function;
-        pool->queue[pool->tail].argument = argument;
-        pool->tail = next;
-        pool->count += 1;
-
-        /* pthread_cond_broadcast */
-        if (cnd_signal(&(pool->notify)) != thrd_success)
+    }
+    else
+    {
+        /* Follow-up work stays with the worker that created it */
+        threadpool_worker_t *worker = current_worker;
+        if (worker != NULL && worker->pool == pool)
         {
-            err = threadpool_lock_failure;
-            break;
+            queued = deque_push(&worker->deque, function, argument);
+        }
+        for (int i = 0; queued != 0 && i < pool->worker_count; i++)
+        {
+            unsigned next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+            queued = ring_push(&pool->workers[next % (unsigned)pool->worker_count].inbox, &task);
         }
-    } while (0);
+    }
 
-    if (mtx_unlock(&pool->lock) != thrd_success)
+    /* Are we full ? */
+    if (queued != 0)
     {
-        err = threadpool_lock_failure;
+        if (admission)
+        {
+            /* Refusing now beats a connection that hangs until it times out */
+            __atomic_fetch_add(&pool->stats.shed, 1, __ATOMIC_RELAXED);
+            pool->shed(argument);
+            return 0;
+        }
+        return threadpool_queue_full;
     }
 
-    return err;
+    /* Pairs with the fence in threadpool_thread(): either the worker sees
+       the task or we see the worker going to sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    threadpool_wake(pool);
+    if (pool->elastic)
+    {
+        threadpool_grow(pool);
+    }
+    return 0;
 }
 
 int threadpool_destroy(threadpool_t *pool, int flags)
@@ -194,39 +946,34 @@ int threadpool_destroy(threadpool_t *pool, int flags)
         return threadpool_invalid;
     }
 
-    if (mtx_lock(&(pool->lock)) != thrd_success)
+    /* Already shutting down */
+    int running = 0;
+    int shutdown = (flags & threadpool_graceful) ? graceful_shutdown : immediate_shutdown;
+    if (!__atomic_compare_exchange_n(&pool->shutdown, &running, shutdown, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
     {
-        return threadpool_lock_failure;
+        return threadpool_shutdown;
     }
 
-    do
-    {
-        /* Already shutting down */
-        if (pool->shutdown)
-        {
-            err = threadpool_shutdown;
-            break;
-        }
+    /* No worker starts or retires past this point */
+    mtx_lock(&(pool->resize));
+    mtx_unlock(&(pool->resize));
 
-        pool->shutdown = (flags & threadpool_graceful) ? graceful_shutdown : immediate_shutdown;
+    /* Wake up all worker threads */
+    threadpool_unpark(pool, INT_MAX);
 
-        /* Wake up all worker threads */
-        if ((cnd_broadcast(&(pool->notify)) != thrd_success) ||
-            (mtx_unlock(&(pool->lock)) != thrd_success))
+    /* Join all worker thread, retired ones included */
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        if (__atomic_load_n(&pool->workers[i].state, __ATOMIC_RELAXED) == worker_vacant)
         {
-            err = threadpool_lock_failure;
-            break;
+            continue;
         }
-
-        /* Join all worker thread */
-        for (i = 0; i < pool->thread_count; i++)
+        if (thrd_join(pool->threads[i], NULL) != thrd_success)
         {
-            if (thrd_join(pool->threads[i], NULL) != thrd_success)
-            {
-                err = threadpool_thread_failure;
-            }
+            err = threadpool_thread_failure;
         }
-    } while (0);
+    }
 
     /* Only if everything went well do we deallocate the pool */
     if (!err)
@@ -236,9 +983,24 @@ int threadpool_destroy(threadpool_t *pool, int flags)
     return err;
 }
 
+void threadpool_stats(threadpool_t *pool, threadpool_stats_t *stats)
+{
+    stats->threads = __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+    mtx_lock(&(pool->resize));
+    stats->peak = pool->stats.peak;
+    mtx_unlock(&(pool->resize));
+    stats->spawned = __atomic_load_n(&pool->stats.spawned, __ATOMIC_RELAXED);
+    stats->retired = __atomic_load_n(&pool->stats.retired, __ATOMIC_RELAXED);
+    stats->spawn_failures = __atomic_load_n(&pool->stats.spawn_failures, __ATOMIC_RELAXED);
+    stats->queue_wait = (unsigned long long)__atomic_load_n(&pool->queue_wait, __ATOMIC_RELAXED) / 1000;
+    stats->shed = __atomic_load_n(&pool->stats.shed, __ATOMIC_RELAXED);
+    stats->lifo = __atomic_load_n(&pool->stats.lifo, __ATOMIC_RELAXED);
+    stats->overloaded = __atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED);
+}
+
 int threadpool_free(threadpool_t *pool)
 {
-    if (pool == NULL || pool->started > 0)
+    if (pool == NULL || __atomic_load_n(&pool->started, __ATOMIC_ACQUIRE) > 0)
     {
         return -1;
     }
@@ -247,59 +1009,169 @@ int threadpool_free(threadpool_t *pool)
     if (pool->threads)
     {
         free(pool->threads);
-        free(pool->queue);
+        free(pool->queue.cells);
+        if (pool->workers)
+        {
+            for (int i = 0; i < pool->worker_count; i++)
+            {
+                free(pool->workers[i].deque.tasks);
+                free(pool->workers[i].inbox.cells);
+            }
+        }
 
         /* Because we allocate pool->threads after initializing the
            mutex and condition variable, we're sure they're
-           initialized. Let's lock the mutex just in case. */
-        mtx_lock(&(pool->lock));
+           initialized. */
         mtx_destroy(&(pool->lock));
         cnd_destroy(&(pool->notify));
+        mtx_destroy(&(pool->resize));
+        mtx_destroy(&(pool->lifo_lock));
+        free(pool->lifo);
     }
+    free(pool->workers);
     free(pool);
     return 0;
 }
 
-static void *threadpool_thread(void *threadpool)
+/* Feeds one sojourn into the controller, returns 1 if the task should be refused */
+static int codel_shed(threadpool_t *pool, long long sojourn, long long now)
 {
-    threadpool_t *pool = (threadpool_t *)threadpool;
-    threadpool_task_t task;
-
-    for (;;)
+    long long end = __atomic_load_n(&pool->interval_end, __ATOMIC_ACQUIRE);
+    if (now >= end &&
+        __atomic_compare_exchange_n(&pool->interval_end, &end, now + pool->codel_interval, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
     {
-        /* Lock must be taken to wait on conditional variable */
-        mtx_lock(&(pool->lock));
+        /* An interval without admission tasks says nothing. Served newest
+           first, fresh tasks look fast while the old ones still wait, so
+           overload only ends once that backlog is gone */
+        long long shortest = __atomic_exchange_n(&pool->min_delay, LLONG_MAX, __ATOMIC_ACQ_REL);
+        int overloaded = shortest != LLONG_MAX && shortest > pool->codel_target;
+        if (__atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED) && !ring_empty(&pool->queue))
+        {
+            overloaded = 1;
+        }
+        __atomic_store_n(&pool->overloaded, overloaded, __ATOMIC_RELAXED);
+    }
+
+    long long shortest = __atomic_load_n(&pool->min_delay, __ATOMIC_RELAXED);
+    while (sojourn < shortest &&
+           !__atomic_compare_exchange_n(&pool->min_delay, &shortest, sojourn, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return __atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED) && sojourn > 2 * pool->codel_target;
+}
 
-        /* Wait on condition variable, check for spurious wakeups.
-           When returning from cnd_wait(), we own the lock. */
-        while ((pool->count == 0) && (!pool->shutdown))
+/* Runs a task, noting how long it sat in the queue, or refuses it */
+static void threadpool_run(threadpool_t *pool, threadpool_task_t *task)
+{
+    if (task->enqueued != 0)
+    {
+        long long now = now_ns();
+        long long sojourn = now - task->enqueued;
+        __atomic_store_n(&pool->queue_wait, sojourn, __ATOMIC_RELAXED);
+        if ((task->flags & threadpool_admission) && pool->shed != NULL && codel_shed(pool, sojourn, now))
         {
-            cnd_wait(&(pool->notify), &(pool->lock));
+            __atomic_fetch_add(&pool->stats.shed, 1, __ATOMIC_RELAXED);
+            pool->shed(task->argument);
+            return;
         }
+    }
+    (*(task->function))(task->argument);
+}
+
+static int threadpool_thread(void *arg)
+{
+    threadpool_worker_t *worker = (threadpool_worker_t *)arg;
+    threadpool_t *pool = worker->pool;
+    threadpool_task_t task;
+
+    current_worker = worker;
+    if (worker->cpu >= 0)
+    {
+        /* Best effort, an unpinned worker still works */
+        cpu_pin(worker->cpu);
+    }
+    /* Allocated from this thread, so on its node when pinned */
+    if (pool->stealing && (deque_init(&worker->deque, pool->local) != 0 || ring_init(&worker->inbox, pool->local) != 0))
+    {
+        __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&pool->ready, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&pool->ready, __ATOMIC_ACQUIRE) < pool->min_threads &&
+           !__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+    {
+        thrd_yield();
+    }
+    if (__atomic_load_n(&pool->failed, __ATOMIC_RELAXED))
+    {
+        /* threadpool_create() is tearing the pool down */
+        goto done;
+    }
+    __atomic_store_n(&pool->spawning, 0, __ATOMIC_RELAXED);
 
-        if ((pool->shutdown == immediate_shutdown) ||
-            ((pool->shutdown == graceful_shutdown) &&
-             (pool->count == 0)))
+    for (;;)
+    {
+        int shutdown = __atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE);
+        if (shutdown == immediate_shutdown)
         {
             break;
         }
 
         /* Grab our task */
-        task.function = pool->queue[pool->head].function;
-        task.argument = pool->queue[pool->head].argument;
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->count -= 1;
+        if (threadpool_take(worker, &task) == 0)
+        {
+            /* More behind it, rouse a helper or start one */
+            if (threadpool_backlog(worker))
+            {
+                threadpool_wake(pool);
+                if (pool->elastic)
+                {
+                    threadpool_grow(pool);
+                }
+            }
+            /* Get to work */
+            threadpool_run(pool, &task);
+            continue;
+        }
+        if (shutdown == graceful_shutdown)
+        {
+            break;
+        }
 
-        /* Unlock */
-        mtx_unlock(&(pool->lock));
+        /* Announce the nap, then look once more before taking it */
+        unsigned seen = __atomic_load_n(&pool->epoch, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (threadpool_take(worker, &task) == 0)
+        {
+            __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_RELAXED);
+            threadpool_run(pool, &task);
+            continue;
+        }
+        int timed_out = 0;
+        if (!__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE))
+        {
+            timed_out = threadpool_park(pool, seen, pool->elastic ? pool->idle_timeout : 0);
+            /* Whoever woke us can wake the next one */
+            if (!timed_out)
+            {
+                __atomic_store_n(&pool->waking, 0, __ATOMIC_RELEASE);
+            }
+        }
+        __atomic_fetch_sub(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
 
-        /* Get to work */
-        (*(task.function))(task.argument);
+        /* Pairs with the fence in threadpool_add(): a task queued while we
+           still counted as asleep is seen here and keeps us around */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (timed_out && queue_empty(pool) && threadpool_retire(worker))
+        {
+            break;
+        }
     }
 
-    pool->started--;
-
-    mtx_unlock(&(pool->lock));
+done:
+    current_worker = NULL;
+    __atomic_fetch_sub(&pool->started, 1, __ATOMIC_RELEASE);
     thrd_exit(0);
-    return (NULL);
+    return 0;
 }
@@ -2,6 +2,8 @@
 #ifndef _THREADPOOL_H_
 #define _THREADPOOL_H_
 
+#include <stddef.h>
+
 #include "tinycthread.h"
 
 #ifdef __cplusplus
@@ -20,6 +22,9 @@ extern "C"
      */
 #define MAX_THREADS 64
 #define MAX_QUEUE 65536
+#define THREADPOOL_SPAWN_WAIT 1000 // microseconds a task may wait before the pool grows
+#define THREADPOOL_SPAWN_DEPTH 16  // queued tasks that make the pool grow
+#define THREADPOOL_CODEL_INTERVAL 100 // milliseconds
 
     typedef struct threadpool_t threadpool_t;
 
@@ -37,25 +42,136 @@ extern "C"
         threadpool_graceful = 1
     } threadpool_destroy_flags_t;
 
+    /**
+     * threadpool_admission puts a task under admission control when the
+     * pool has a shed routine: it may be handed to shed instead of being
+     * run, see threadpool_options_t.
+     */
+    typedef enum
+    {
+        threadpool_admission = 1
+    } threadpool_add_flags_t;
+
+    /**
+     * threadpool_work_stealing gives every worker its own deque instead of
+     * one shared queue. Tasks added by a worker stay on that worker's deque,
+     * tasks added from other threads are dealt round-robin, and a worker
+     * that runs dry steals from a random other one.
+     *
+     * threadpool_pin_workers binds worker i to the i-th processor of the
+     * affinity mask, wrapping around. Each worker allocates its own queues
+     * after it is pinned, so they sit on its NUMA node.
+     */
+    typedef enum
+    {
+        threadpool_work_stealing = 1,
+        threadpool_pin_workers = 2
+    } threadpool_create_flags_t;
+
+    /**
+     *  @struct threadpool_options_t
+     *  @brief Settings for threadpool_create_with()
+     *
+     *  A pool whose min_threads is below its thread count is elastic: it
+     *  starts min_threads workers and adds one, up to the thread count,
+     *  whenever no worker is idle and either spawn_depth tasks are queued
+     *  or the last task taken had waited spawn_wait microseconds. A worker
+     *  that found nothing to do for idle_timeout milliseconds exits while
+     *  more than min_threads are running. Work stealing pools are fixed.
+     *
+     *  With a shed routine, tasks added with threadpool_admission are
+     *  subject to CoDel-style admission control. A task's sojourn time is
+     *  how long it waited in the queue. When even the shortest sojourn
+     *  over a codel_interval stayed above codel_target, the queue is
+     *  standing rather than absorbing a burst. Until an interval passes
+     *  below target, tasks that waited more than twice the target are
+     *  given to shed instead of being run, and new tasks are served
+     *  newest first, ahead of the backlog. A task that finds the queue
+     *  full is shed at once on the adding thread.
+     *
+     *  @var flags        threadpool_create_flags_t values.
+     *  @var stack_size   Bytes of stack per worker, 0 for the system default.
+     *  @var min_threads  Workers kept running, 0 for a fixed pool.
+     *  @var idle_timeout Milliseconds before a spare worker exits, 0 to
+     *                    keep workers once started.
+     *  @var spawn_wait   0 for THREADPOOL_SPAWN_WAIT.
+     *  @var spawn_depth  0 for THREADPOOL_SPAWN_DEPTH.
+     *  @var codel_target Milliseconds of acceptable standing queue delay,
+     *                    0 to turn admission control off.
+     *  @var codel_interval Milliseconds over which the shortest delay is
+     *                    taken, 0 for THREADPOOL_CODEL_INTERVAL.
+     *  @var shed         Receives the argument of a refused task, must
+     *                    release it. NULL to turn admission control off.
+     */
+    typedef struct
+    {
+        int flags;
+        size_t stack_size;
+        int min_threads;
+        int idle_timeout;
+        int spawn_wait;
+        int spawn_depth;
+        int codel_target;
+        int codel_interval;
+        void (*shed)(void *);
+    } threadpool_options_t;
+
+    /**
+     *  @struct threadpool_stats_t
+     *  @brief Scaling counters of a pool
+     *
+     *  @var threads        Workers running now.
+     *  @var peak           Most workers ever running at once.
+     *  @var spawned        Workers added because of queue pressure.
+     *  @var retired        Workers that exited after idle_timeout.
+     *  @var spawn_failures Workers that could not be started.
+     *  @var queue_wait     Microseconds the most recently taken task waited.
+     *  @var shed           Tasks refused by admission control.
+     *  @var lifo           Tasks queued newest first while overloaded.
+     *  @var overloaded     The last interval kept its delay above target.
+     */
+    typedef struct
+    {
+        int threads;
+        int peak;
+        unsigned long long spawned;
+        unsigned long long retired;
+        unsigned long long spawn_failures;
+        unsigned long long queue_wait;
+        unsigned long long shed;
+        unsigned long long lifo;
+        int overloaded;
+    } threadpool_stats_t;
+
     /**
      * @function threadpool_create
      * @brief Creates a threadpool_t object.
-     * @param thread_count Number of worker threads.
-     * @param queue_size   Size of the queue.
-     * @param flags        Unused parameter.
+     * @param thread_count Number of worker threads, the most an elastic
+     *                     pool grows to.
+     * @param queue_size   Size of the queue, rounded up to a power of two.
+     *                     With work stealing it is split between workers.
+     * @param flags        0 or threadpool_work_stealing.
      * @return a newly created thread pool or NULL
      */
     threadpool_t *threadpool_create(int thread_count, int queue_size, int flags);
 
+    /**
+     * @function threadpool_create_with
+     * @brief Like threadpool_create(), with every setting spelled out.
+     * @return a newly created thread pool or NULL
+     */
+    threadpool_t *threadpool_create_with(int thread_count, int queue_size,
+                                         const threadpool_options_t *options);
+
     /**
      * @function threadpool_add
      * @brief add a new task in the queue of a thread pool
      * @param pool     Thread pool to which add the task.
      * @param function Pointer to the function that will perform the task.
      * @param argument Argument to be passed to the function.
-     * @param flags    Unused parameter.
-     * @return 0 if all goes well, negative values in case of error (@see
-     * threadpool_error_t for codes).
+     * @param flags    0 or threadpool_admission.
+     * @return 0 if all goes well, shed included, negative values in case
+     * of error (@see threadpool_error_t for codes).
      */
     int threadpool_add(threadpool_t *pool, void (*routine)(void *),
                        void *arg, int flags);
@@ -72,6 +188,12 @@ extern "C"
      */
     int threadpool_destroy(threadpool_t *pool, int flags);
 
+    /**
+     * @function threadpool_stats
+     * @brief Reads the scaling counters. Safe to call from any thread.
+     */
+    void threadpool_stats(threadpool_t *pool, threadpool_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
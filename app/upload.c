@@ -0,0 +1,369 @@
+/**
+ * @file upload.c
+ * @brief Streams a request body from a socket into a file
+ */
+
+#define _GNU_SOURCE // splice, pipe2, mkostemp, F_SETPIPE_SZ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "upload.h"
+
+typedef enum
+{
+    f_data = 0,
+    f_size,
+    f_size_lf,
+    f_extension,
+    f_data_cr,
+    f_data_lf,
+    f_trailer,
+    f_trailer_line,
+    f_trailer_lf
+} upload_framing_t;
+
+static void upload_release(upload_t *upload)
+{
+    if (upload->file_fd != -1)
+    {
+        close(upload->file_fd);
+    }
+    if (upload->pipe_fd[0] != -1)
+    {
+        close(upload->pipe_fd[0]);
+        close(upload->pipe_fd[1]);
+    }
+    upload_init(upload);
+}
+
+void upload_init(upload_t *upload)
+{
+    memset(upload, 0, sizeof(upload_t));
+    upload->state = upload_idle;
+    upload->file_fd = -1;
+    upload->pipe_fd[0] = upload->pipe_fd[1] = -1;
+}
+
+int upload_start(upload_t *upload, arena_t *arena, const char *path, int chunked, unsigned long long length, unsigned long long limit)
+{
+    size_t path_length = strlen(path);
+
+    upload_init(upload);
+    upload->path = arena_strdup(arena, path);
+    upload->temp_path = (char *)arena_alloc(arena, path_length + sizeof(".XXXXXX"));
+    if (upload->path == NULL || upload->temp_path == NULL)
+    {
+        errno = ENOMEM;
+        goto err;
+    }
+    memcpy(upload->temp_path, path, path_length);
+    memcpy(upload->temp_path + path_length, ".XXXXXX", sizeof(".XXXXXX"));
+
+    upload->file_fd = mkostemp(upload->temp_path, O_CLOEXEC);
+    if (upload->file_fd == -1)
+    {
+        goto err;
+    }
+    fchmod(upload->file_fd, 0644);
+
+    if (pipe2(upload->pipe_fd, O_CLOEXEC) == -1)
+    {
+        upload->pipe_fd[0] = upload->pipe_fd[1] = -1;
+        goto err;
+    }
+    /* A bigger pipe means fewer splice() round trips, the default still works */
+    fcntl(upload->pipe_fd[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+
+    upload->state = upload_receiving;
+    upload->chunked = chunked;
+    upload->framing = chunked ? f_size : f_data;
+    upload->remaining = chunked ? 0 : length;
+    upload->limit = limit;
+    if (!chunked && length == 0)
+    {
+        upload->state = upload_done;
+    }
+    return 0;
+
+err:
+    upload_abort(upload);
+    return -1;
+}
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void account(upload_t *upload, size_t n)
+{
+    upload->received += n;
+    upload->remaining -= n;
+    if (upload->limit && upload->received > upload->limit)
+    {
+        upload->state = upload_too_large;
+        return;
+    }
+    if (upload->remaining == 0)
+    {
+        if (!upload->chunked)
+        {
+            upload->state = upload_done;
+        }
+        else
+        {
+            upload->framing = f_data_cr;
+        }
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/* One byte of chunk framing: size line, CRLF after the data, trailer section */
+static int frame_byte(upload_t *upload, char c)
+{
+    switch (upload->framing)
+    {
+    case f_size:
+    {
+        int digit = hex_value(c);
+        if (digit >= 0)
+        {
+            if (upload->remaining >> 60)
+            {
+                return -1;
+            }
+            upload->remaining = upload->remaining * 16 + digit;
+            upload->digits++;
+            return 0;
+        }
+        if (upload->digits == 0)
+        {
+            return -1;
+        }
+        if (c == ';' || c == ' ' || c == '\t')
+        {
+            upload->framing = f_extension;
+            return 0;
+        }
+        if (c == '\r')
+        {
+            upload->framing = f_size_lf;
+            return 0;
+        }
+        if (c != '\n')
+        {
+            return -1;
+        }
+    }
+        /* fall through */
+    case f_size_lf:
+    case f_extension:
+        if (c != '\n')
+        {
+            return upload->framing == f_size_lf ? -1 : 0;
+        }
+        upload->digits = 0;
+        upload->framing = upload->remaining ? f_data : f_trailer;
+        /* A chunk that cannot fit is refused before its data is read */
+        if (upload->limit && upload->remaining > upload->limit - upload->received)
+        {
+            upload->state = upload_too_large;
+        }
+        return 0;
+
+    case f_data_cr:
+        if (c == '\r')
+        {
+            upload->framing = f_data_lf;
+            return 0;
+        }
+        /* fall through */
+    case f_data_lf:
+        if (c != '\n')
+        {
+            return -1;
+        }
+        upload->framing = f_size;
+        return 0;
+
+    case f_trailer:
+        if (c == '\r')
+        {
+            upload->framing = f_trailer_lf;
+            return 0;
+        }
+        if (c == '\n')
+        {
+            upload->state = upload_done;
+            return 0;
+        }
+        upload->framing = f_trailer_line;
+        return 0;
+
+    case f_trailer_line:
+        if (c == '\n')
+        {
+            upload->framing = f_trailer;
+        }
+        return 0;
+
+    case f_trailer_lf:
+        if (c != '\n')
+        {
+            return -1;
+        }
+        upload->state = upload_done;
+        return 0;
+    }
+    return -1;
+}
+
+int upload_receive(upload_t *upload, int socket_fd, char *buffer, size_t *length)
+{
+    size_t used = 0;
+    int status = 0;
+
+    while (upload->state == upload_receiving)
+    {
+        /* Bytes that arrived with the headers or with chunk framing */
+        if (used < *length)
+        {
+            if (upload->framing == f_data)
+            {
+                size_t n = *length - used;
+                if (n > upload->remaining)
+                {
+                    n = upload->remaining;
+                }
+                if (write_all(upload->file_fd, buffer + used, n) != 0)
+                {
+                    status = -1;
+                    goto out;
+                }
+                account(upload, n);
+                used += n;
+            }
+            else if (frame_byte(upload, buffer[used++]) != 0)
+            {
+                status = -1;
+                goto out;
+            }
+            continue;
+        }
+
+        ssize_t n;
+        if (upload->framing == f_data)
+        {
+            /* Chunk or body data: socket -> pipe -> file, no user-space copy */
+            size_t want = upload->remaining < UPLOAD_PIPE_SIZE ? upload->remaining : UPLOAD_PIPE_SIZE;
+            n = splice(socket_fd, NULL, upload->pipe_fd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                ssize_t piped = n;
+                while (piped > 0)
+                {
+                    ssize_t m = splice(upload->pipe_fd[0], NULL, upload->file_fd, NULL, piped, SPLICE_F_MOVE);
+                    if (m <= 0 && !(m == -1 && errno == EINTR))
+                    {
+                        status = -1;
+                        goto out;
+                    }
+                    piped -= m > 0 ? m : 0;
+                }
+                account(upload, n);
+                continue;
+            }
+        }
+        else
+        {
+            /* Framing is parsed from the buffer, read only a little past it */
+            used = *length = 0;
+            n = recv(socket_fd, buffer, UPLOAD_FRAMING_READ, 0);
+            if (n > 0)
+            {
+                *length = n;
+                continue;
+            }
+        }
+
+        if (n == 0)
+        {
+            status = -1; /* hung up mid-body */
+            goto out;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            status = -1;
+        }
+        goto out;
+    }
+
+out:
+    /* Keep whatever follows the body, it is the next request */
+    memmove(buffer, buffer + used, *length - used);
+    *length -= used;
+    if (status == 0 && (upload->state == upload_done || upload->state == upload_too_large))
+    {
+        status = 1;
+    }
+    return status;
+}
+
+int upload_commit(upload_t *upload)
+{
+    int status = rename(upload->temp_path, upload->path);
+    if (status != 0)
+    {
+        unlink(upload->temp_path);
+    }
+    upload_release(upload);
+    return status == 0 ? 0 : -1;
+}
+
+void upload_abort(upload_t *upload)
+{
+    if (upload->temp_path != NULL && upload->file_fd != -1)
+    {
+        unlink(upload->temp_path);
+    }
+    upload_release(upload);
+}
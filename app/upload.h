@@ -0,0 +1,112 @@
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @file upload.h
+     * @brief Streams a request body from a socket into a file
+     *
+     * Body bytes move socket -> pipe -> file with splice(), so they never
+     * enter user space and memory use does not depend on the upload size.
+     * Content-Length and chunked bodies are both supported. For chunked
+     * bodies the framing lines are read into the connection buffer and
+     * the chunk data between them is spliced. The body is written to a
+     * temporary file next to the target and renamed over it by
+     * upload_commit(), so readers never see a partial file.
+     */
+
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#define UPLOAD_FRAMING_READ 512 // recv size while looking for chunk framing
+
+    typedef enum
+    {
+        upload_idle = 0,
+        upload_receiving = 1,
+        upload_done = 2,
+        upload_too_large = 3 /* went over the limit, the rest of the body is left unread */
+    } upload_state_t;
+
+    /**
+     *  @struct upload_t
+     *  @brief State of one streamed body
+     *
+     *  @var state      Where the upload stands.
+     *  @var file_fd    Temporary file receiving the body.
+     *  @var pipe_fd    splice() needs a pipe on one side.
+     *  @var path       Final name, in the caller's arena.
+     *  @var temp_path  Name of file_fd until upload_commit(), in the
+     *                  caller's arena.
+     *  @var chunked    Body uses chunked transfer coding.
+     *  @var framing    Chunked decoder state.
+     *  @var digits     Hex digits seen on the current chunk-size line.
+     *  @var remaining  Bytes left in the body or the current chunk.
+     *  @var received   Body bytes written so far.
+     *  @var limit      Largest body accepted, 0 for no limit.
+     */
+    typedef struct
+    {
+        upload_state_t state;
+        int file_fd;
+        int pipe_fd[2];
+        char *path;
+        char *temp_path;
+        int chunked;
+        int framing;
+        int digits;
+        unsigned long long remaining;
+        unsigned long long received;
+        unsigned long long limit;
+    } upload_t;
+
+    /**
+     * @function upload_init
+     * @brief Resets an upload to upload_idle without releasing anything.
+     */
+    void upload_init(upload_t *upload);
+
+    /**
+     * @function upload_start
+     * @brief Opens a temporary file next to path for a body of length bytes,
+     *        or a chunked body when chunked is set. The file names are
+     *        kept in arena, which must outlive the upload.
+     * @return 0 on success, -1 with errno set
+     */
+    int upload_start(upload_t *upload, arena_t *arena, const char *path, int chunked, unsigned long long length, unsigned long long limit);
+
+    /**
+     * @function upload_receive
+     * @brief Consumes the *length bytes already buffered, then reads the
+     *        socket until it would block or the body ends. Bytes past the
+     *        end of the body are left at the start of buffer.
+     * @return 1 when the body is complete or went over the limit, which
+     * leaves the upload in upload_too_large, 0 on EAGAIN, -1 on error, a
+     * malformed body or a peer that hung up early
+     */
+    int upload_receive(upload_t *upload, int socket_fd, char *buffer, size_t *length);
+
+    /**
+     * @function upload_commit
+     * @brief Renames the completed file into place and releases the upload.
+     * @return 0 on success, -1 if the file could not be moved
+     */
+    int upload_commit(upload_t *upload);
+
+    /**
+     * @function upload_abort
+     * @brief Removes the temporary file and releases the upload.
+     */
+    void upload_abort(upload_t *upload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UPLOAD_H_ */
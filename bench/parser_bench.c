@@ -0,0 +1,115 @@
+/**
+ * @file parser_bench.c
+ * @brief Request parser throughput benchmark
+ *
+ * make bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../app/parser.h"
+#include "../app/scan.h"
+#include "../app/headers.h"
+#include "../app/colors.h"
+
+#define ITERATIONS 1000000
+
+static const char *requests[] = {
+	"GET /echo/abc HTTP/1.1\r\n"
+	"Host: localhost:4221\r\n"
+	"User-Agent: oha/1.4.0\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+
+	"GET /files/index.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+	"Cookie: session=2f1d6a0b7c3e4f5a9b8c7d6e5f4a3b2c1d0e9f8a7b6c5d4e3f2a1b0c9d8e7f6a; _ga=GA1.1.1234567890.1700000000; _ga_XYZ=GS1.1.1700000000.1.1.1700000001.0.0.0\r\n"
+	"If-None-Match: \"5e3b-61a2f9c0b8e40\"\r\n"
+	"\r\n",
+};
+
+/* Keeps the compiler from dropping work whose result is unused */
+static volatile size_t sink;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fragment == 0 parses the whole request in one call */
+static void bench(const char *name, const char *request, size_t fragment, int table)
+{
+	size_t length = strlen(request);
+	http_parser_t parser;
+	header_table_t header_table;
+	int headers = 0;
+
+	double start = now_seconds();
+	for (int i = 0; i < ITERATIONS; i++)
+	{
+		http_parse_status_t status = http_parse_again;
+		http_parser_init(&parser);
+		for (size_t available = fragment ? fragment : length; status == http_parse_again; available += fragment)
+		{
+			status = http_parse(&parser, request, available < length ? available : length);
+		}
+		if (status != http_parse_complete)
+		{
+			printf(RED "Parse failed: %s\n" RESET, name);
+			exit(1);
+		}
+		headers += parser.header_count;
+		if (table)
+		{
+			header_table_build(&header_table, request, &parser);
+			sink += header_get(&header_table, header_user_agent).length;
+		}
+	}
+	double elapsed = now_seconds() - start;
+
+	printf(CYAN "%-28s" RESET " %4zu bytes %2d headers  %8.1f ns/req  %8.0f MB/s  %6.2f Mreq/s\n",
+		   name, length, headers / ITERATIONS,
+		   elapsed * 1e9 / ITERATIONS,
+		   (double)length * ITERATIONS / elapsed / 1e6,
+		   ITERATIONS / elapsed / 1e6);
+}
+
+int main(void)
+{
+	static const char *levels[] = {"scalar", "sse4.2", "avx2"};
+
+	for (int level = scan_scalar; level <= scan_avx2; level++)
+	{
+		if (scan_set_level((scan_level_t)level) != 0)
+		{
+			printf(YELLOW "%s: not supported by this CPU\n" RESET, levels[level]);
+			continue;
+		}
+		printf(GREEN "%s\n" RESET, levels[level]);
+		bench("small, one read", requests[0], 0, 0);
+		bench("small, 16 byte reads", requests[0], 16, 0);
+		bench("browser, one read", requests[1], 0, 0);
+		bench("browser, 64 byte reads", requests[1], 64, 0);
+		bench("browser, + header table", requests[1], 0, 1);
+	}
+	return 0;
+}
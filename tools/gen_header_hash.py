@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+"""
+Generates app/header_hash.h and app/header_hash.c: a minimal perfect hash
+over well-known request header names.
+
+A name hashes in one pass (FNV-1a over c | 0x20, which lowercases ASCII
+letters), picks a bucket, and the bucket's displacement picks the slot:
+
+    h    = fnv1a(name)
+    slot = ((h >> 32) ^ (displacement[h % BUCKETS] * 0x9e3779b1)) % COUNT
+
+Every known name lands on its own slot and there are exactly COUNT slots.
+A lookup is one hash, one table read and one case-insensitive compare.
+
+    python3 tools/gen_header_hash.py
+"""
+
+import os
+
+HEADERS = [
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Encoding",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "Expect",
+    "Forwarded",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Origin",
+    "Pragma",
+    "Range",
+    "Referer",
+    "TE",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Via",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Real-IP",
+    "X-Request-ID",
+]
+
+MASK64 = (1 << 64) - 1
+MASK32 = (1 << 32) - 1
+
+
+def fnv1a(name):
+    h = 0xcbf29ce484222325
+    for c in name.encode():
+        h ^= c | 0x20
+        h = (h * 0x100000001b3) & MASK64
+    return h
+
+
+def slot(h, displacement, count):
+    return ((h >> 32) ^ ((displacement * 0x9e3779b1) & MASK32)) % count
+
+
+def generate(count, buckets):
+    grouped = [[] for _ in range(buckets)]
+    for name in HEADERS:
+        h = fnv1a(name)
+        grouped[h % buckets].append((name, h))
+
+    displacements = [0] * buckets
+    taken = {}
+    # Place the most crowded buckets first while slots are still free
+    for bucket in sorted(range(buckets), key=lambda b: -len(grouped[b])):
+        if not grouped[bucket]:
+            continue
+        for d in range(1 << 16):
+            slots = [slot(h, d, count) for _, h in grouped[bucket]]
+            if len(set(slots)) == len(slots) and not any(s in taken for s in slots):
+                displacements[bucket] = d
+                for (name, _), s in zip(grouped[bucket], slots):
+                    taken[s] = name
+                break
+        else:
+            return None
+    return displacements, taken
+
+
+def identifier(name):
+    return "header_" + name.lower().replace("-", "_")
+
+
+def main():
+    count = len(HEADERS)
+    for buckets in range(count // 4, count + 1):
+        result = generate(count, buckets)
+        if result:
+            break
+    else:
+        raise SystemExit("no perfect hash found")
+    displacements, taken = result
+
+    root = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "app")
+    banner = "/* Generated by tools/gen_header_hash.py, do not edit */\n"
+
+    with open(os.path.join(root, "header_hash.h"), "w") as f:
+        f.write(banner)
+        f.write("#ifndef _HEADER_HASH_H_\n#define _HEADER_HASH_H_\n\n")
+        f.write("#include <stdint.h>\n\n")
+        f.write("#define HEADER_KNOWN_COUNT %d\n" % count)
+        f.write("#define HEADER_HASH_BUCKETS %d\n\n" % buckets)
+        f.write("typedef enum\n{\n")
+        f.write("    header_unknown = -1,\n")
+        for i, name in enumerate(HEADERS):
+            f.write("    %s = %d,\n" % (identifier(name), i))
+        f.write("} header_id_t;\n\n")
+        f.write("extern const char *const header_names[HEADER_KNOWN_COUNT];\n")
+        f.write("extern const uint8_t header_name_lengths[HEADER_KNOWN_COUNT];\n")
+        f.write("extern const uint16_t header_hash_displacements[HEADER_HASH_BUCKETS];\n")
+        f.write("extern const int8_t header_hash_slots[HEADER_KNOWN_COUNT];\n\n")
+        f.write("#endif /* _HEADER_HASH_H_ */\n")
+
+    with open(os.path.join(root, "header_hash.c"), "w") as f:
+        f.write(banner + "\n")
+        f.write('#include "header_hash.h"\n\n')
+        f.write("const char *const header_names[HEADER_KNOWN_COUNT] = {\n")
+        for name in HEADERS:
+            f.write('    "%s",\n' % name)
+        f.write("};\n\n")
+        f.write("const uint8_t header_name_lengths[HEADER_KNOWN_COUNT] = {\n")
+        for name in HEADERS:
+            f.write("    %d,\n" % len(name))
+        f.write("};\n\n")
+        f.write("const uint16_t header_hash_displacements[HEADER_HASH_BUCKETS] = {\n")
+        for i in range(0, buckets, 8):
+            f.write("    " + " ".join("%d," % d for d in displacements[i:i + 8]) + "\n")
+        f.write("};\n\n")
+        f.write("/* Slot to header_id_t */\n")
+        f.write("const int8_t header_hash_slots[HEADER_KNOWN_COUNT] = {\n")
+        for s in range(count):
+            f.write("    %s,\n" % identifier(taken[s]))
+        f.write("};\n")
+
+
+if __name__ == "__main__":
+    main()